@@ -23,15 +23,15 @@ TEST_CASE("Classic box") {
                "../raytracer/debug/classic_box_normal2.png");
 }
 
-// TEST_CASE("Deer") {
-//     CameraOptions camera_opts{.screen_width = 500,
-//                               .screen_height = 500,
-//                               .look_from = {100., 200., 150.},
-//                               .look_to = {0., 100., 0.}};
-//     RenderOptions render_opts{1, RenderMode::kDepth};
-//     // CheckImage("deer/CERF_Free.obj", "deer/depth.png", camera_opts, render_opts,
-//     //            "../raytracer/debug/deer_depth_debug.png");
-//     render_opts.mode = RenderMode::kNormal;
-//     CheckImage("deer/CERF_Free.obj", "deer/normal.png", camera_opts, render_opts,
-//                "../raytracer/debug/deer_normal_debug.png");
-// }
+TEST_CASE("Deer") {
+    CameraOptions camera_opts{.screen_width = 500,
+                              .screen_height = 500,
+                              .look_from = {100., 200., 150.},
+                              .look_to = {0., 100., 0.}};
+    RenderOptions render_opts{1, RenderMode::kDepth};
+    CheckImage("deer/CERF_Free.obj", "deer/depth.png", camera_opts, render_opts,
+               "../raytracer/debug/deer_depth_debug.png");
+    render_opts.mode = RenderMode::kNormal;
+    CheckImage("deer/CERF_Free.obj", "deer/normal.png", camera_opts, render_opts,
+               "../raytracer/debug/deer_normal_debug.png");
+}
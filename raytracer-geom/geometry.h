@@ -11,7 +11,7 @@
 #include <optional>
 #include <ostream>
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+std::optional<double> GetIntersectionDistance(const Ray& ray, const Sphere& sphere) {
     const Vector& o = ray.GetOrigin();
     const Vector& d = ray.GetDirection();
     const Vector& c = sphere.GetCenter();
@@ -38,19 +38,29 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere
     if (Compare(t) < 0) {
         return std::nullopt;
     }
+    return t;
+}
 
-    Vector pos = o + (d * t);
-    Vector n = pos - c;
-    n.Normalize();
+std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+    auto t = GetIntersectionDistance(ray, sphere);
+    if (!t) {
+        return std::nullopt;
+    }
+
+    const Vector& o = ray.GetOrigin();
+    const Vector& d = ray.GetDirection();
+    Vector pos = o + (d * *t);
+    Vector n = pos - sphere.GetCenter();
 
     if (DotProduct(n, d) > 0.0) {
         n *= -1.0;
     }
 
-    return Intersection(pos, n, t);
+    // Intersection normalizes the normal.
+    return Intersection(pos, n, *t);
 }
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+std::optional<double> GetIntersectionDistance(const Ray& ray, const Triangle& triangle) {
     const Vector& o = ray.GetOrigin();
     const Vector& d = ray.GetDirection();
 
@@ -85,31 +95,41 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
     if (Compare(t) < 0) {
         return std::nullopt;
     }
+    return t;
+}
 
-    Vector pos = o + (d * t);
-    Vector n = CrossProduct(e1, e2);
-    n.Normalize();
+std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+    auto t = GetIntersectionDistance(ray, triangle);
+    if (!t) {
+        return std::nullopt;
+    }
+
+    const Vector& o = ray.GetOrigin();
+    const Vector& d = ray.GetDirection();
+    Vector pos = o + (d * *t);
+    Vector n = CrossProduct(triangle[1] - triangle[0], triangle[2] - triangle[0]);
 
     if (DotProduct(n, d) > 0.0) {
         n *= -1.0;
     }
 
-    return Intersection(pos, n, t);
+    return Intersection(pos, n, *t);
 }
 
-Vector Reflect(const Vector& ray, const Vector& normal) {
-    Vector n = normal;
-    n.Normalize();
-    double proj = DotProduct(ray, n);
-    return ray - n * (2.0 * proj);
+// Reflect for a unit normal. A unit ray gives a unit result.
+Vector ReflectUnit(const Vector& ray, const Vector& normal) {
+    double proj = DotProduct(ray, normal);
+    return ray - normal * (2.0 * proj);
 }
 
-std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double eta) {
-    Vector i = ray;
-    i.Normalize();
+Vector Reflect(const Vector& ray, const Vector& normal) {
     Vector n = normal;
     n.Normalize();
+    return ReflectUnit(ray, n);
+}
 
+// Refract for a unit ray and a unit normal, the result is unit too.
+std::optional<Vector> RefractUnit(const Vector& i, Vector n, double eta) {
     double cosi = DotProduct(i, n);
     double eta_ratio = eta;
     if (cosi > 0.0) {
@@ -129,6 +149,14 @@ std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double et
     return t;
 }
 
+std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double eta) {
+    Vector i = ray;
+    i.Normalize();
+    Vector n = normal;
+    n.Normalize();
+    return RefractUnit(i, n, eta);
+}
+
 Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
     const Vector& a = triangle[0];
     const Vector& b = triangle[1];
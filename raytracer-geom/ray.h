@@ -2,10 +2,29 @@
 
 #include "vector.h"
 
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+
+// Ray with a unit direction. Besides the direction it keeps what box tests need from it: the
+// inverse of every component (infinity for a zero one) and the signs.
 class Ray {
 public:
+    // Marks a direction the caller already knows to be unit, e.g. a unit vector reflected about
+    // a unit normal, so the constructor doesn't normalize it again.
+    struct UnitDirection {};
+    static constexpr UnitDirection kUnitDirection{};
+
     Ray(const Vector& origin, const Vector& direction) : o_(origin), d_(direction) {
         d_.Normalize();
+        Prepare();
+    }
+
+    Ray(const Vector& origin, const Vector& direction, UnitDirection)
+        : o_(origin), d_(direction) {
+        assert(std::abs(Length(d_) - 1) < 1e-6 && "direction is not unit");
+        Prepare();
     }
 
     const Vector& GetOrigin() const {
@@ -15,7 +34,26 @@ public:
         return d_;
     }
 
+    // 1 / GetDirection()[i] for every i.
+    const Vector& GetInverseDirection() const {
+        return inv_d_;
+    }
+
+    // 1 if the direction goes towards smaller values on the axis (including -0.0), 0 otherwise.
+    int GetSign(size_t axis) const {
+        return sign_[axis];
+    }
+
 private:
+    void Prepare() {
+        for (size_t i = 0; i < 3; ++i) {
+            inv_d_[i] = 1.0 / d_[i];
+            sign_[i] = std::signbit(d_[i]);
+        }
+    }
+
     Vector o_;
     Vector d_;
+    Vector inv_d_;
+    std::array<uint8_t, 3> sign_;
 };
@@ -4,6 +4,7 @@
 #include "intersection.h"
 #include "triangle.h"
 #include "ray.h"
+#include "transform.h"
 #include "utils.h"
 
 #include <cmath>
@@ -149,6 +150,21 @@ TEST_CASE("Cross product") {
     CheckWithinAbs(CrossProduct({0, 0, kZ}, {kX, 0, 0}), {0, kZ * kX, 0});
 }
 
+TEST_CASE("Ray") {
+    Ray ray{{1, 2, 3}, {0, -3, 4}};
+    CheckWithinAbs(ray.GetDirection(), {0, -.6, .8});
+    CHECK(std::isinf(ray.GetInverseDirection()[0]));
+    CHECK_THAT(ray.GetInverseDirection()[1], WithinAbs(-1 / .6));
+    CHECK_THAT(ray.GetInverseDirection()[2], WithinAbs(1 / .8));
+    CHECK(ray.GetSign(0) == 0);
+    CHECK(ray.GetSign(1) == 1);
+    CHECK(ray.GetSign(2) == 0);
+
+    Ray unit{{1, 2, 3}, {0, -.6, .8}, Ray::kUnitDirection};
+    CheckEquals(unit.GetDirection(), {0, -.6, .8});
+    CHECK(Ray({0, 0, 0}, {-0., 1, 0}).GetSign(0) == 1);
+}
+
 TEST_CASE("Triangle") {
     {
         Triangle triangle{{kX, 0, 0}, {0, kY, 0}, {0, 0, 0}};
@@ -297,3 +313,24 @@ TEST_CASE("Barycentric coords") {
         CheckCoords(t, {10, 7, 6}, {3. / 6, 2. / 6, 1. / 6});
     }
 }
+
+TEST_CASE("Transform") {
+    Transform transform{{Vector{0, -2, 0}, Vector{2, 0, 0}, Vector{0, 0, 3}}, {1, 2, 3}};
+    CheckWithinAbs(transform.ApplyToPoint({1, 1, 1}), {-1, 4, 6});
+    CheckWithinAbs(transform.ApplyToDirection({1, 1, 1}), {-2, 2, 3});
+
+    auto inverse = transform.Inverse();
+    for (const auto& p : {Vector{1, 1, 1}, Vector{kX, kY, kZ}, Vector{-3, 0, 5}}) {
+        CheckWithinAbs(inverse.ApplyToPoint(transform.ApplyToPoint(p)), p);
+        CheckWithinAbs(transform.ApplyToPoint(inverse.ApplyToPoint(p)), p);
+    }
+
+    // The normal of the plane z = x stays orthogonal to the transformed plane.
+    auto normal = inverse.ApplyTransposed({1, 0, -1});
+    for (const auto& d : {Vector{1, 0, 1}, Vector{0, 1, 0}}) {
+        CHECK_THAT(DotProduct(normal, transform.ApplyToDirection(d)), WithinAbs(0.));
+    }
+
+    Transform singular{{Vector{1, 0, 0}, Vector{2, 0, 0}, Vector{0, 0, 1}}, {}};
+    CHECK_THROWS(singular.Inverse());
+}
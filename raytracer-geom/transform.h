@@ -0,0 +1,72 @@
+#pragma once
+
+#include "vector.h"
+
+#include <array>
+#include <cmath>
+
+// Affine map x -> linear * x + translation, the linear part is stored by rows.
+class Transform {
+public:
+    Transform() : rows_{Vector{1, 0, 0}, Vector{0, 1, 0}, Vector{0, 0, 1}} {
+    }
+
+    Transform(const std::array<Vector, 3>& rows, const Vector& translation)
+        : rows_(rows), translation_(translation) {
+    }
+
+    static Transform Translation(const Vector& translation) {
+        Transform transform;
+        transform.translation_ = translation;
+        return transform;
+    }
+
+    Vector ApplyToPoint(const Vector& p) const {
+        return ApplyToDirection(p) + translation_;
+    }
+
+    // Applies the linear part only.
+    Vector ApplyToDirection(const Vector& d) const {
+        return Vector(DotProduct(rows_[0], d), DotProduct(rows_[1], d), DotProduct(rows_[2], d));
+    }
+
+    // Applies the transposed linear part. Normals are mapped by the transposed inverse, so a
+    // normal of a transformed surface is the inverse's ApplyTransposed of the original one.
+    Vector ApplyTransposed(const Vector& n) const {
+        return rows_[0] * n[0] + rows_[1] * n[1] + rows_[2] * n[2];
+    }
+
+    Transform Inverse() const {
+        // The rows of the inverse matrix are the cross products of the columns, divided by the
+        // determinant.
+        std::array<Vector, 3> columns;
+        for (size_t i = 0; i < 3; ++i) {
+            columns[i] = Vector(rows_[0][i], rows_[1][i], rows_[2][i]);
+        }
+        std::array<Vector, 3> rows{CrossProduct(columns[1], columns[2]),
+                                   CrossProduct(columns[2], columns[0]),
+                                   CrossProduct(columns[0], columns[1])};
+        double det = DotProduct(columns[0], rows[0]);
+        if (det == 0 || !std::isfinite(det)) {
+            throw "transform is not invertible";
+        }
+        for (auto& row : rows) {
+            row *= 1 / det;
+        }
+        Transform inverse{rows, Vector{}};
+        inverse.translation_ = inverse.ApplyToDirection(translation_) * -1.0;
+        return inverse;
+    }
+
+    const Vector& GetRow(size_t index) const {
+        return rows_[index];
+    }
+
+    const Vector& GetTranslation() const {
+        return translation_;
+    }
+
+private:
+    std::array<Vector, 3> rows_;
+    Vector translation_;
+};
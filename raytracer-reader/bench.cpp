@@ -0,0 +1,50 @@
+#include "scene.h"
+#include "scene_cache.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Measures ReadScene and loading from a scene cache on the given .obj files, by default on the
+// raytracer test scenes.
+// Usage: bench_raytracer_reader [repetitions] [file.obj...]
+int main(int argc, char** argv) {
+    int repetitions = argc > 1 ? std::stoi(argv[1]) : 10;
+    std::vector<std::filesystem::path> paths(argv + std::min(argc, 2), argv + argc);
+    if (paths.empty()) {
+        const auto tests_dir = GetRelativeDir(__FILE__, "../raytracer/tests");
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(tests_dir)) {
+            if (entry.path().extension() == ".obj") {
+                paths.push_back(entry.path());
+            }
+        }
+    }
+
+    auto measure = [&](auto&& read) {
+        size_t objects = 0;
+        Timer timer;
+        for (int i = 0; i < repetitions; ++i) {
+            objects = read().GetMesh().Size();
+        }
+        auto [wall_time, cpu_time] = timer.GetTimes();
+        auto spent = std::chrono::duration<double, std::milli>{wall_time} / repetitions;
+        return std::pair{objects, spent.count()};
+    };
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        const auto& path = paths[i];
+        auto cache_path = std::filesystem::temp_directory_path() /
+                          ("bench_raytracer_reader_" + std::to_string(i) + ".cache");
+        WriteSceneCache(ReadScene(path), path, cache_path);
+
+        auto [objects, parse_time] = measure([&] { return ReadScene(path); });
+        auto cache_time = measure([&] { return ReadSceneCached(path, cache_path); }).second;
+        std::cout << path.string() << ": " << objects << " triangles, " << parse_time
+                  << " ms per load, " << cache_time << " ms per cached load\n";
+        std::filesystem::remove(cache_path);
+    }
+}
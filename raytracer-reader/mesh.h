@@ -0,0 +1,93 @@
+#pragma once
+
+#include "geometry.h"
+#include "material.h"
+#include "object.h"
+#include "triangle.h"
+#include "vector.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Normal index of a triangle that has no normals in the file and uses its flat normal.
+const uint32_t kNoNormal = std::numeric_limits<uint32_t>::max();
+
+// Corners of one triangle as indices into the vertex and normal pools of its mesh.
+struct MeshTriangle {
+    std::array<uint32_t, 3> vertexes;
+    std::array<uint32_t, 3> normals;
+};
+
+// Triangles of a scene stored as shared vertex and normal pools plus 32-bit index triples, so a
+// vertex shared by several faces is stored once and a triangle takes 32 bytes instead of the
+// ~160 of a standalone Object.
+class Mesh {
+public:
+    Mesh() = default;
+
+    // The i-th triangle has material materials[i].
+    Mesh(std::vector<Vector>&& vertexes, std::vector<Vector>&& normals,
+         std::vector<MeshTriangle>&& triangles, std::vector<const Material*>&& materials)
+        : vertexes_(std::move(vertexes)),
+          normals_(std::move(normals)),
+          triangles_(std::move(triangles)),
+          materials_(std::move(materials)) {
+    }
+
+    size_t Size() const {
+        return triangles_.size();
+    }
+
+    Triangle GetTriangle(size_t index) const {
+        const auto& v = triangles_[index].vertexes;
+        return Triangle(vertexes_[v[0]], vertexes_[v[1]], vertexes_[v[2]]);
+    }
+
+    // Normals at the corners, the flat normal at all three if the file gave none.
+    std::array<Vector, 3> GetNormals(size_t index) const {
+        const auto& n = triangles_[index].normals;
+        if (n[0] == kNoNormal) {
+            const auto& v = triangles_[index].vertexes;
+            auto flat = GetNormal(vertexes_[v[0]], vertexes_[v[1]], vertexes_[v[2]]);
+            return {flat, flat, flat};
+        }
+        return {normals_[n[0]], normals_[n[1]], normals_[n[2]]};
+    }
+
+    const Material* GetMaterial(size_t index) const {
+        return materials_[index];
+    }
+
+    const std::vector<Vector>& GetVertexPool() const {
+        return vertexes_;
+    }
+
+    const std::vector<Vector>& GetNormalPool() const {
+        return normals_;
+    }
+
+    const std::vector<MeshTriangle>& GetTriangles() const {
+        return triangles_;
+    }
+
+private:
+    std::vector<Vector> vertexes_;
+    std::vector<Vector> normals_;
+    std::vector<MeshTriangle> triangles_;
+    std::vector<const Material*> materials_;
+};
+
+// Triangles of the mesh as standalone objects, built anew on every call. The renderer works on
+// the mesh and never needs them.
+std::vector<Object> GetObjects(const Mesh& mesh) {
+    std::vector<Object> res;
+    res.reserve(mesh.Size());
+    for (size_t i = 0; i < mesh.Size(); ++i) {
+        res.emplace_back(mesh.GetTriangle(i), mesh.GetNormals(i), mesh.GetMaterial(i));
+    }
+    return res;
+}
@@ -1,16 +1,87 @@
 #pragma once
 
 #include "material.h"
+#include "mesh.h"
 #include "vector.h"
 #include "object.h"
 #include "light.h"
 #include "geometry.h"
+#include "transform.h"
 
+#include <algorithm>
+#include <array>
 #include <vector>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <filesystem>
-#include <sstream>
+#include <charconv>
+#include <cstring>
+#include <tuple>
+#include <utility>
+#include <cstdint>
+
+// Parses a number at [p, end) like istream >> does (a leading '+' is allowed), leaving value
+// untouched on failure. Returns the position after the number, nullptr on failure.
+template <class T>
+const char* ParseNumber(const char* p, const char* end, T& value) {
+    if (p != end && *p == '+') {
+        ++p;
+    }
+    auto [ptr, ec] = std::from_chars(p, end, value);
+    if (ec != std::errc()) {
+        return nullptr;
+    }
+    return ptr;
+}
+
+// Splits one line of an .obj or .mtl file into whitespace separated tokens without copying it.
+class LineParser {
+public:
+    explicit LineParser(std::string_view line) : line_(line) {
+    }
+
+    // Next token, empty if there are none left.
+    std::string_view NextToken() {
+        size_t begin = 0;
+        while (begin < line_.size() && IsSpace(line_[begin])) {
+            ++begin;
+        }
+        size_t end = begin;
+        while (end < line_.size() && !IsSpace(line_[end])) {
+            ++end;
+        }
+        auto token = line_.substr(begin, end - begin);
+        line_.remove_prefix(end);
+        return token;
+    }
+
+    // Next token as a number, 0 if it's missing or malformed.
+    double NextDouble() {
+        double x = 0;
+        auto token = NextToken();
+        ParseNumber(token.data(), token.data() + token.size(), x);
+        return x;
+    }
+
+private:
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+
+    std::string_view line_;
+};
+
+// Calls on_line(line) for every line of the text, without the line terminator.
+template <class OnLine>
+void ForEachLine(std::string_view text, OnLine&& on_line) {
+    while (!text.empty()) {
+        const void* newline = std::memchr(text.data(), '\n', text.size());
+        size_t size = newline ? static_cast<const char*>(newline) - text.data() : text.size();
+        on_line(text.substr(0, size));
+        text.remove_prefix(std::min(size + 1, text.size()));
+    }
+}
 
 void NegativeIndex(int& x, int n) {
     if (x < 0) {
@@ -18,89 +89,194 @@ void NegativeIndex(int& x, int n) {
     }
 }
 
-std::tuple<int, int, int> ParseNode(const std::string& node) {
+// Parses a face node "v", "v/vt", "v//vn" or "v/vt/vn", missing indices are 0.
+std::tuple<int, int, int> ParseNode(std::string_view node) {
     int a = 0, b = 0, c = 0;
-    std::istringstream in(node);
-    if (!(in >> a)) {
+    const char* end = node.data() + node.size();
+    const char* p = ParseNumber(node.data(), end, a);
+    if (!p) {
         return {0, 0, 0};
     }
-    in >> std::ws;
-    if (in.peek() == '/') {
-        in.get();
-
-        in >> std::ws;
-        if (in.peek() == '/') {
-            in.get();
-            (in >> c);
+    if (p != end && *p == '/') {
+        ++p;
+        if (p != end && *p == '/') {
+            ParseNumber(p + 1, end, c);
         } else {
-            if (in >> b) {
-                in >> std::ws;
-                if (in.peek() == '/') {
-                    in.get();
-                    (in >> c);
-                }
+            p = ParseNumber(p, end, b);
+            if (p && p != end && *p == '/') {
+                ParseNumber(p + 1, end, c);
             }
         }
     }
     return {a, b, c};
 }
 
-std::vector<Object> ReadObject(std::istringstream& in, const std::vector<Vector>& verexes,
-                               const std::vector<Vector>& normals) {
-    std::vector<Object> res;
+// One triangle of a face as written in the file. Negative (relative) indices are resolved later,
+// so the face remembers how many vertexes and normals its chunk had read before it.
+struct RawTriangle {
+    std::array<int, 3> v;
+    std::array<int, 3> n;
+    uint32_t vertexes_before;
+    uint32_t normals_before;
+    int material;  // index of the chunk's usemtl event in effect, -1 if set by an earlier chunk
+};
 
-    std::vector<std::string> nodes;
-    std::string node;
-    while (in >> node) {
-        nodes.push_back(node);
-    }
-    int n = nodes.size();
-    if (n < 3) {
+// Triangulates the face as a fan around its first node and appends the triangles to triangles.
+void ReadObject(LineParser& in, uint32_t vertexes_before, uint32_t normals_before, int material,
+                std::vector<RawTriangle>* triangles) {
+    auto first = in.NextToken();
+    auto previous = in.NextToken();
+    auto node = in.NextToken();
+    if (node.empty()) {
         throw "f must contain at least 3 nodes";
     }
-    for (int i = 1; i + 1 < n; ++i) {
-        auto [v1, c1, n1] = ParseNode(nodes[0]);
-        auto [v2, c2, n2] = ParseNode(nodes[i]);
-        auto [v3, c3, n3] = ParseNode(nodes[i + 1]);
-        NegativeIndex(n1, normals.size());
-        NegativeIndex(n2, normals.size());
-        NegativeIndex(n3, normals.size());
-        NegativeIndex(v1, verexes.size());
-        NegativeIndex(v2, verexes.size());
-        NegativeIndex(v3, verexes.size());
-        auto a = verexes[v1 - 1];
-        auto b = verexes[v2 - 1];
-        auto c = verexes[v3 - 1];
-        Triangle t(a, b, c);
-        std::array<Vector, 3> nrms;
-        if (n1 != 0) {
-            nrms[0] = normals[n1 - 1];
-            nrms[1] = normals[n2 - 1];
-            nrms[2] = normals[n3 - 1];
-        } else {
-            auto n = GetNormal(a, b, c);
-            nrms[0] = n;
-            nrms[1] = n;
-            nrms[2] = n;
-        }
-        res.push_back(Object(t, nrms));
+    auto [v1, c1, n1] = ParseNode(first);
+    for (; !node.empty(); previous = node, node = in.NextToken()) {
+        auto [v2, c2, n2] = ParseNode(previous);
+        auto [v3, c3, n3] = ParseNode(node);
+        triangles->push_back(
+            RawTriangle{{v1, v2, v3}, {n1, n2, n3}, vertexes_before, normals_before, material});
     }
-    return res;
 }
 
-SphereObject ReadSphere(std::istringstream& in) {
-    double x, y, z, r;
-    in >> x >> y >> z >> r;
-    return SphereObject(Sphere(Vector(x, y, z), r));
+// Resolves the indices of a triangle whose chunk starts after vertex_offset vertexes and
+// normal_offset normals of the file into 0-based indices into the file's pools.
+MeshTriangle MakeMeshTriangle(const RawTriangle& raw, uint32_t vertex_offset,
+                              uint32_t normal_offset) {
+    auto [v1, v2, v3] = raw.v;
+    auto [n1, n2, n3] = raw.n;
+    NegativeIndex(n1, normal_offset + raw.normals_before);
+    NegativeIndex(n2, normal_offset + raw.normals_before);
+    NegativeIndex(n3, normal_offset + raw.normals_before);
+    NegativeIndex(v1, vertex_offset + raw.vertexes_before);
+    NegativeIndex(v2, vertex_offset + raw.vertexes_before);
+    NegativeIndex(v3, vertex_offset + raw.vertexes_before);
+    MeshTriangle triangle{{static_cast<uint32_t>(v1 - 1), static_cast<uint32_t>(v2 - 1),
+                           static_cast<uint32_t>(v3 - 1)},
+                          {kNoNormal, kNoNormal, kNoNormal}};
+    if (n1 != 0) {
+        triangle.normals = {static_cast<uint32_t>(n1 - 1), static_cast<uint32_t>(n2 - 1),
+                            static_cast<uint32_t>(n3 - 1)};
+    }
+    return triangle;
 }
 
-Vector ReadVector(std::istringstream& in) {
-    double x, y, z;
-    in >> x >> y >> z;
+Vector ReadVector(LineParser& in) {
+    double x = in.NextDouble();
+    double y = in.NextDouble();
+    double z = in.NextDouble();
     return Vector(x, y, z);
 }
 
-Light ReadLight(std::istringstream& in) {
+SphereObject ReadSphere(LineParser& in) {
+    Vector center = ReadVector(in);
+    double r = in.NextDouble();
+    return SphereObject(Sphere(center, r));
+}
+
+Light ReadLight(LineParser& in) {
     Vector positiion = ReadVector(in), intensity = ReadVector(in);
     return Light{positiion, intensity};
 }
+
+// "I file x y z" places a copy of the triangles of another .obj file moved by (x, y, z), and
+// "I file m00 m01 m02 m03 m10 ... m23" transforms it by the 3x4 matrix given by rows, the last
+// column being the translation.
+struct RawInstance {
+    std::string path;
+    Transform transform;
+};
+
+RawInstance ReadInstance(LineParser& in) {
+    RawInstance instance{std::string{in.NextToken()}, {}};
+    if (instance.path.empty()) {
+        throw "I must name a file";
+    }
+    std::vector<double> numbers;
+    for (auto token = in.NextToken(); !token.empty(); token = in.NextToken()) {
+        double x = 0;
+        if (ParseNumber(token.data(), token.data() + token.size(), x) !=
+            token.data() + token.size()) {
+            throw "I must be followed by numbers";
+        }
+        numbers.push_back(x);
+    }
+    if (numbers.size() == 3) {
+        instance.transform = Transform::Translation({numbers[0], numbers[1], numbers[2]});
+    } else if (numbers.size() == 12) {
+        std::array<Vector, 3> rows;
+        for (size_t i = 0; i < 3; ++i) {
+            rows[i] = Vector(numbers[4 * i], numbers[4 * i + 1], numbers[4 * i + 2]);
+        }
+        instance.transform = Transform{rows, {numbers[3], numbers[7], numbers[11]}};
+    } else {
+        throw "I must have a translation or a 3x4 matrix";
+    }
+    return instance;
+}
+
+// mtllib or usemtl statement, these have to be replayed in file order after parsing.
+struct MaterialEvent {
+    bool is_library;
+    std::string name;
+};
+
+// Everything read from one line-aligned chunk of an .obj file. Parts that depend on earlier
+// chunks (relative indices, the material in effect) are kept raw for ReadScene to resolve.
+struct ObjChunk {
+    std::vector<Vector> vertexes;
+    std::vector<Vector> normals;
+    std::vector<RawTriangle> triangles;
+    std::vector<std::pair<SphereObject, int>> spheres;  // with the usemtl index as in RawTriangle
+    std::vector<Light> lights;
+    std::vector<MaterialEvent> events;
+    std::vector<RawInstance> instances;
+};
+
+ObjChunk ReadObjChunk(std::string_view text) {
+    ObjChunk chunk;
+    int material = -1;
+    ForEachLine(text, [&](std::string_view line) {
+        LineParser in(line);
+        auto type = in.NextToken();
+        if (type.empty() || type[0] == '#') {
+            return;
+        }
+
+        if (type == "mtllib") {
+            chunk.events.push_back({true, std::string{in.NextToken()}});
+        } else if (type == "usemtl") {
+            material = chunk.events.size();
+            chunk.events.push_back({false, std::string{in.NextToken()}});
+        } else if (type == "S") {
+            chunk.spheres.emplace_back(ReadSphere(in), material);
+        } else if (type == "v") {
+            chunk.vertexes.push_back(ReadVector(in));
+        } else if (type == "vn") {
+            chunk.normals.push_back(ReadVector(in));
+        } else if (type == "f") {
+            ReadObject(in, chunk.vertexes.size(), chunk.normals.size(), material,
+                       &chunk.triangles);
+        } else if (type == "P") {
+            chunk.lights.push_back(ReadLight(in));
+        } else if (type == "I") {
+            chunk.instances.push_back(ReadInstance(in));
+        }
+    });
+    return chunk;
+}
+
+// Splits the text into at most count pieces of at least min_size bytes, each ending at a line end.
+std::vector<std::string_view> SplitIntoChunks(std::string_view text, size_t count,
+                                              size_t min_size) {
+    count = std::max<size_t>(1, std::min(count, text.size() / std::max<size_t>(1, min_size)));
+    std::vector<std::string_view> chunks;
+    for (size_t left = count; !text.empty(); --left) {
+        size_t size = text.size() / left;
+        auto newline = text.find('\n', size == 0 ? 0 : size - 1);
+        size = newline == std::string_view::npos ? text.size() : newline + 1;
+        chunks.push_back(text.substr(0, size));
+        text.remove_prefix(size);
+    }
+    return chunks;
+}
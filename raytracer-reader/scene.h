@@ -1,30 +1,54 @@
 #pragma once
 
 #include "material.h"
+#include "mesh.h"
 #include "vector.h"
 #include "object.h"
 #include "light.h"
+#include "mapped_file.h"
 #include "read.h"
+#include "transform.h"
+#include "thread_pool.h"
 
 #include <vector>
 #include <unordered_map>
 #include <string>
 #include <filesystem>
-#include <fstream>
-#include <sstream>
-#include <iostream>
+#include <string_view>
+#include <cstdint>
+
+// A prototype of the scene placed by a transform. The inverse is kept for mapping rays into the
+// space of the prototype.
+struct MeshInstance {
+    uint32_t prototype;  // index into Scene::GetPrototypes()
+    Transform transform;
+    Transform inverse;
+
+    MeshInstance(uint32_t prototype, const Transform& transform)
+        : prototype(prototype), transform(transform), inverse(transform.Inverse()) {
+    }
+};
 
 class Scene {
 public:
-    Scene(std::vector<Object>&& objects, std::vector<SphereObject>&& spheres,
-          std::vector<Light>&& lights, std::unordered_map<std::string, Material>&& materials)
-        : objects_(std::move(objects)),
+    Scene(Mesh&& mesh, std::vector<SphereObject>&& spheres, std::vector<Light>&& lights,
+          std::unordered_map<std::string, Material>&& materials,
+          std::vector<std::filesystem::path>&& material_libraries = {},
+          std::vector<Scene>&& prototypes = {}, std::vector<MeshInstance>&& instances = {})
+        : mesh_(std::move(mesh)),
           spheres_(std::move(spheres)),
           lights_(std::move(lights)),
-          materials_(std::move(materials)) {
+          materials_(std::move(materials)),
+          material_libraries_(std::move(material_libraries)),
+          prototypes_(std::move(prototypes)),
+          instances_(std::move(instances)) {
+    }
+    const Mesh& GetMesh() const {
+        return mesh_;
     }
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    // Triangles of the mesh as standalone objects, see GetObjects(const Mesh&).
+    std::vector<Object> GetObjects() const {
+        return ::GetObjects(mesh_);
     }
     const std::vector<SphereObject>& GetSphereObjects() const {
         return spheres_;
@@ -35,41 +59,52 @@ public:
     const std::unordered_map<std::string, Material>& GetMaterials() const {
         return materials_;
     }
+    // .mtl files the materials were read from.
+    const std::vector<std::filesystem::path>& GetMaterialLibraries() const {
+        return material_libraries_;
+    }
+
+    // Scenes read from the files the instances refer to, each file once however many instances
+    // it has. Only their meshes are used, with their own materials.
+    const std::vector<Scene>& GetPrototypes() const {
+        return prototypes_;
+    }
+    // Copies of the prototypes' meshes in the order the file places them. They are not part of
+    // GetMesh() or GetObjects(), so memory grows with the unique geometry only.
+    const std::vector<MeshInstance>& GetInstances() const {
+        return instances_;
+    }
 
 private:
-    std::vector<Object> objects_;
+    Mesh mesh_;
     std::vector<SphereObject> spheres_;
     std::vector<Light> lights_;
     std::unordered_map<std::string, Material> materials_;
+    std::vector<std::filesystem::path> material_libraries_;
+    std::vector<Scene> prototypes_;
+    std::vector<MeshInstance> instances_;
 };
 
 std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::path& path) {
-    // auto&  logger =
     std::unordered_map<std::string, Material> res;
-    std::ifstream file(path.c_str(), std::ios::in);
-    std::string line;
+    MappedFile file(path);
 
     Material current;
     current.name = "";
 
-    while (std::getline(file, line)) {
-        std::istringstream in(line);
-        std::string type;
-        if (!(in >> type)) {
-            continue;
+    ForEachLine(file.Data(), [&](std::string_view line) {
+        LineParser in(line);
+        auto type = in.NextToken();
+        if (type.empty() || type[0] == '#') {
+            return;
         }
 
-        if (!type.empty() && type[0] == '#') {
-            continue;
-        }
-
-        // logger << type << std::endl;
         if (type == "newmtl") {
             if (!current.name.empty()) {
                 res[current.name] = current;
             }
             current = {};
-            in >> current.name;
+            current.name = in.NextToken();
         } else if (type == "Ka") {
             current.ambient_color = ReadVector(in);
         } else if (type == "Ke") {
@@ -78,19 +113,14 @@ std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::p
             current.diffuse_color = ReadVector(in);
         } else if (type == "Ks") {
             current.specular_color = ReadVector(in);
-
         } else if (type == "Ns") {
-            in >> current.specular_exponent;
+            current.specular_exponent = in.NextDouble();
         } else if (type == "Ni") {
-            in >> current.refraction_index;
+            current.refraction_index = in.NextDouble();
         } else if (type == "al") {
             current.albedo = ReadVector(in);
-        } else {
-            {
-                // logger << type << "SKIPPED" << std::endl;
-            }
         }
-    }
+    });
 
     if (!current.name.empty()) {
         res[current.name] = current;
@@ -98,74 +128,111 @@ std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::p
     return res;
 }
 
-Scene ReadScene(const std::filesystem::path& path) {
-    // auto&  logger =
-    std::vector<Object> objects;
-    std::vector<SphereObject> spheres;
-    std::vector<Light> lights;
-    std::unordered_map<std::string, Material> materials;
+const size_t kMinChunkSize = 1 << 20;
+
+// Reads the .obj file on the given number of threads (0 means one per hardware thread). The file
+// is split into line-aligned chunks of at least min_chunk_size bytes which are parsed in
+// parallel; a cheap sequential pass then replays mtllib/usemtl statements in file order and
+// computes where each chunk's vertexes and normals start, so relative indices resolve exactly
+// as in a sequential read. Files placed by I statements are read the same way, but they can't
+// place instances themselves (allow_instances is false for them).
+Scene ReadScene(const std::filesystem::path& path, int threads,
+                size_t min_chunk_size = kMinChunkSize, bool allow_instances = true) {
+    MappedFile file(path);
+    auto texts = SplitIntoChunks(file.Data(), GetThreadCount(threads), min_chunk_size);
+    std::vector<ObjChunk> chunks(texts.size());
+    ParallelFor(chunks.size(), threads, [&](size_t i) { chunks[i] = ReadObjChunk(texts[i]); });
 
+    std::unordered_map<std::string, Material> materials;
+    std::vector<std::filesystem::path> material_libraries;
+    std::vector<std::vector<const Material*>> chunk_materials(chunks.size());
+    std::vector<const Material*> inherited_materials(chunks.size());
+    std::vector<uint32_t> vertex_offsets(chunks.size()), normal_offsets(chunks.size());
     std::vector<Vector> vertexes;
     std::vector<Vector> normals;
-
-    std::ifstream file(path.c_str(), std::ios::in);
-    std::string line;
-    Material* current_material = nullptr;
-
-    while (std::getline(file, line)) {
-        std::istringstream in(line);
-        std::string type;
-        if (!(in >> type)) {
-            continue;
-        }
-        if (!type.empty() && type[0] == '#') {
-            continue;
+    std::vector<SphereObject> spheres;
+    std::vector<Light> lights;
+    std::vector<Scene> prototypes;
+    std::unordered_map<std::string, uint32_t> prototype_indices;
+    std::vector<MeshInstance> instances;
+    const Material* current_material = nullptr;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        inherited_materials[i] = current_material;
+        for (const auto& event : chunks[i].events) {
+            if (event.is_library) {
+                std::filesystem::path newpath(path);
+                newpath.replace_filename(event.name);
+                auto mats = ReadMaterials(newpath);
+                for (auto& [k, v] : mats) {
+                    materials[k] = v;
+                }
+                material_libraries.push_back(newpath);
+            } else {
+                auto it = materials.find(event.name);
+                if (it == materials.end()) {
+                    throw "unexpected material";
+                }
+                current_material = &it->second;
+            }
+            chunk_materials[i].push_back(current_material);
         }
 
-        // logger << type << std::endl;
-        if (type == "mtllib") {
-            std::string name;
-            in >> name;
-            std::filesystem::path newpath(path);
-            newpath.replace_filename(name);
-            auto mats = ReadMaterials(newpath);
-            for (auto [k, v] : mats) {
-                // logger << "add material: " << k << std::endl;
-                materials[k] = v;
-            }
-        } else if (type == "usemtl") {
-            std::string name;
-            in >> name;
-            // logger << "current material: " << name << std::endl;
-            if (materials.count(name) == 0) {
-                throw "unexpected material";
-            }
-            current_material = &materials[name];
-        } else if (type == "S") {
-            auto s = ReadSphere(in);
-            s.material = current_material;
+        vertex_offsets[i] = vertexes.size();
+        normal_offsets[i] = normals.size();
+        vertexes.insert(vertexes.end(), chunks[i].vertexes.begin(), chunks[i].vertexes.end());
+        normals.insert(normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+        for (auto [s, material] : chunks[i].spheres) {
+            s.material = material < 0 ? inherited_materials[i] : chunk_materials[i][material];
             spheres.push_back(s);
-            // logger << "sphere added" << std::endl;
-        } else if (type == "v") {
-            vertexes.push_back(ReadVector(in));
-            // logger << "vertex added" << std::endl;
-        } else if (type == "vn") {
-            normals.push_back(ReadVector(in));
-            // logger << "normal added" << std::endl;
-        } else if (type == "f") {
-            auto triangles = ReadObject(in, vertexes, normals);
-            for (auto t : triangles) {
-                t.material = current_material;
-                objects.push_back(t);
-                // logger << "object added" << std::endl;
+        }
+        lights.insert(lights.end(), chunks[i].lights.begin(), chunks[i].lights.end());
+        for (const auto& raw : chunks[i].instances) {
+            if (!allow_instances) {
+                throw "an instanced file can't have instances";
             }
-        } else if (type == "P") {
-            lights.push_back(ReadLight(in));
-            // logger << "light added" << std::endl;
-
-        } else {
-            // logger << type << " SKIPPED" << std::endl;
+            std::filesystem::path newpath(path);
+            newpath.replace_filename(raw.path);
+            newpath = newpath.lexically_normal();
+            auto [it, inserted] =
+                prototype_indices.try_emplace(newpath.string(), prototypes.size());
+            if (inserted) {
+                prototypes.push_back(ReadScene(newpath, threads, min_chunk_size, false));
+            }
+            instances.emplace_back(it->second, raw.transform);
         }
     }
-    return Scene{std::move(objects), std::move(spheres), std::move(lights), std::move(materials)};
+
+    size_t triangle_count = 0;
+    std::vector<size_t> triangle_offsets(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        triangle_offsets[i] = triangle_count;
+        triangle_count += chunks[i].triangles.size();
+    }
+    std::vector<MeshTriangle> triangles(triangle_count);
+    std::vector<const Material*> triangle_materials(triangle_count);
+    ParallelFor(chunks.size(), threads, [&](size_t i) {
+        for (size_t j = 0; j < chunks[i].triangles.size(); ++j) {
+            const auto& raw = chunks[i].triangles[j];
+            auto triangle = MakeMeshTriangle(raw, vertex_offsets[i], normal_offsets[i]);
+            bool has_normals = triangle.normals[0] != kNoNormal;
+            for (size_t k = 0; k < 3; ++k) {
+                if (triangle.vertexes[k] >= vertexes.size() ||
+                    (has_normals && triangle.normals[k] >= normals.size())) {
+                    throw "f refers to a missing vertex or normal";
+                }
+            }
+            triangles[triangle_offsets[i] + j] = triangle;
+            triangle_materials[triangle_offsets[i] + j] =
+                raw.material < 0 ? inherited_materials[i] : chunk_materials[i][raw.material];
+        }
+    });
+
+    Mesh mesh{std::move(vertexes), std::move(normals), std::move(triangles),
+              std::move(triangle_materials)};
+    return Scene{std::move(mesh), std::move(spheres), std::move(lights), std::move(materials),
+                 std::move(material_libraries), std::move(prototypes), std::move(instances)};
+}
+
+Scene ReadScene(const std::filesystem::path& path) {
+    return ReadScene(path, 0);
 }
@@ -0,0 +1,396 @@
+#pragma once
+
+#include "light.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "mesh.h"
+#include "object.h"
+#include "scene.h"
+#include "vector.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Binary snapshot of a parsed scene, so that rendering the same scene again skips the .obj
+// parser. All numbers are stored in native byte order:
+//
+//   header     magic, version, sizeof(double)
+//   sources    count, then path, size and modification time of the .obj and every .mtl file
+//   materials  count, then name and all fields of each material
+//   vertexes   count, then the vertex pool of the mesh
+//   normals    count, then the normal pool of the mesh
+//   triangles  count, then 3 vertex indices, 3 normal indices and a material index (-1 for
+//              none) of each
+//   spheres    count, then center, radius and material index of each
+//   lights     count, then position and intensity of each
+//
+// A cache is used only for the .obj file it was written for, and only while all of its sources
+// have the recorded size and modification time.
+// Scenes with instances (I statements) are not cached.
+
+const uint32_t kSceneCacheMagic = 0x43535452;  // "RTSC"
+const uint32_t kSceneCacheVersion = 3;
+
+class SceneCacheWriter {
+public:
+    template <class T>
+    void Write(T value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        buffer_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void Write(const Vector& v) {
+        for (size_t i = 0; i < 3; ++i) {
+            Write(v[i]);
+        }
+    }
+
+    void Write(std::string_view s) {
+        Write<uint64_t>(s.size());
+        buffer_.append(s);
+    }
+
+    const std::string& Data() const {
+        return buffer_;
+    }
+
+private:
+    std::string buffer_;
+};
+
+// Reads values written by SceneCacheWriter. Reading past the end yields zeroes and marks the
+// reader as failed instead of throwing, a broken cache is simply not used.
+class SceneCacheReader {
+public:
+    explicit SceneCacheReader(std::string_view data) : data_(data) {
+    }
+
+    template <class T>
+    T Read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value{};
+        if (data_.size() < sizeof(T)) {
+            failed_ = true;
+            return value;
+        }
+        std::memcpy(&value, data_.data(), sizeof(T));
+        data_.remove_prefix(sizeof(T));
+        return value;
+    }
+
+    Vector ReadVector() {
+        double x = Read<double>();
+        double y = Read<double>();
+        double z = Read<double>();
+        return Vector(x, y, z);
+    }
+
+    std::string ReadString() {
+        auto size = Read<uint64_t>();
+        if (size > data_.size()) {
+            failed_ = true;
+            return {};
+        }
+        std::string s{data_.substr(0, size)};
+        data_.remove_prefix(size);
+        return s;
+    }
+
+    // Number of records that follow, checked against the bytes left so a corrupted count can't
+    // make the caller allocate an absurd amount of memory.
+    size_t ReadCount(size_t min_record_size) {
+        auto count = Read<uint64_t>();
+        if (count > data_.size() / min_record_size) {
+            failed_ = true;
+            return 0;
+        }
+        return count;
+    }
+
+    bool Failed() const {
+        return failed_;
+    }
+
+    bool AtEnd() const {
+        return data_.empty();
+    }
+
+private:
+    std::string_view data_;
+    bool failed_ = false;
+};
+
+struct SceneSource {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+};
+
+// Size and modification time of the file, nullopt if it can't be stat'ed.
+std::optional<SceneSource> GetSceneSource(const std::filesystem::path& path) {
+    std::error_code ec;
+    auto absolute = std::filesystem::absolute(path, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    auto size = std::filesystem::file_size(absolute, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    auto mtime = std::filesystem::last_write_time(absolute, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    return SceneSource{absolute.string(), size, mtime.time_since_epoch().count()};
+}
+
+std::filesystem::path GetSceneCachePath(const std::filesystem::path& path) {
+    auto cache_path = path;
+    cache_path += ".cache";
+    return cache_path;
+}
+
+// Writes the cache for a scene read from path. Failing to write it (e.g. in a read-only
+// directory) is not an error, the scene will just be parsed again next time.
+void WriteSceneCache(const Scene& scene, const std::filesystem::path& path,
+                     const std::filesystem::path& cache_path) {
+    // Instances refer to other files, which the cache doesn't track. Such scenes are parsed
+    // every time, it's the instanced files that hold most of their geometry anyway.
+    if (!scene.GetInstances().empty()) {
+        return;
+    }
+    std::vector<std::filesystem::path> source_paths{path};
+    source_paths.insert(source_paths.end(), scene.GetMaterialLibraries().begin(),
+                        scene.GetMaterialLibraries().end());
+    std::vector<SceneSource> sources;
+    for (const auto& source_path : source_paths) {
+        auto source = GetSceneSource(source_path);
+        if (!source) {
+            return;
+        }
+        sources.push_back(*source);
+    }
+
+    SceneCacheWriter out;
+    out.Write(kSceneCacheMagic);
+    out.Write(kSceneCacheVersion);
+    out.Write<uint32_t>(sizeof(double));
+
+    out.Write<uint64_t>(sources.size());
+    for (const auto& source : sources) {
+        out.Write(std::string_view{source.path});
+        out.Write(source.size);
+        out.Write(source.mtime);
+    }
+
+    std::unordered_map<const Material*, int32_t> material_indices;
+    out.Write<uint64_t>(scene.GetMaterials().size());
+    for (const auto& [name, material] : scene.GetMaterials()) {
+        material_indices[&material] = static_cast<int32_t>(material_indices.size());
+        out.Write(std::string_view{name});
+        out.Write(std::string_view{material.name});
+        out.Write(material.ambient_color);
+        out.Write(material.diffuse_color);
+        out.Write(material.specular_color);
+        out.Write(material.intensity);
+        out.Write(material.specular_exponent);
+        out.Write(material.refraction_index);
+        out.Write(material.albedo);
+    }
+    auto material_index = [&](const Material* material) {
+        return material ? material_indices.at(material) : int32_t{-1};
+    };
+
+    const auto& mesh = scene.GetMesh();
+    for (const auto* pool : {&mesh.GetVertexPool(), &mesh.GetNormalPool()}) {
+        out.Write<uint64_t>(pool->size());
+        for (const auto& v : *pool) {
+            out.Write(v);
+        }
+    }
+    out.Write<uint64_t>(mesh.Size());
+    for (size_t i = 0; i < mesh.Size(); ++i) {
+        out.Write(mesh.GetTriangles()[i]);
+        out.Write(material_index(mesh.GetMaterial(i)));
+    }
+
+    out.Write<uint64_t>(scene.GetSphereObjects().size());
+    for (const auto& sphere : scene.GetSphereObjects()) {
+        out.Write(sphere.sphere.GetCenter());
+        out.Write(sphere.sphere.GetRadius());
+        out.Write(material_index(sphere.material));
+    }
+
+    out.Write<uint64_t>(scene.GetLights().size());
+    for (const auto& light : scene.GetLights()) {
+        out.Write(light.position);
+        out.Write(light.intensity);
+    }
+
+    // Write a temporary file and rename it, so a concurrent reader never sees half a cache.
+    auto temp_path = cache_path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(out.Data().data(), out.Data().size());
+    }
+    std::error_code ec;
+    if (std::filesystem::file_size(temp_path, ec) != out.Data().size()) {
+        std::filesystem::remove(temp_path, ec);
+        return;
+    }
+    std::filesystem::rename(temp_path, cache_path, ec);
+    if (ec) {
+        std::filesystem::remove(temp_path, ec);
+    }
+}
+
+// Loads the scene read from path from the cache, nullopt if the cache is missing, broken, stale
+// or was written for another file.
+std::optional<Scene> ReadSceneCache(const std::filesystem::path& path,
+                                    const std::filesystem::path& cache_path) {
+    auto scene_source = GetSceneSource(path);
+    if (!scene_source) {
+        return std::nullopt;
+    }
+    MappedFile file(cache_path);
+    SceneCacheReader in(file.Data());
+    if (in.Read<uint32_t>() != kSceneCacheMagic || in.Read<uint32_t>() != kSceneCacheVersion ||
+        in.Read<uint32_t>() != sizeof(double)) {
+        return std::nullopt;
+    }
+
+    // The first source is the .obj file, the rest are its material libraries.
+    std::vector<std::filesystem::path> material_libraries;
+    auto source_count = in.ReadCount(sizeof(uint64_t) * 3);
+    if (source_count == 0) {
+        return std::nullopt;
+    }
+    // A cache copied along with its scene still names the original, whose changes it tracks.
+    for (size_t i = 0; i < source_count; ++i) {
+        auto source_path = in.ReadString();
+        auto size = in.Read<uint64_t>();
+        auto mtime = in.Read<int64_t>();
+        auto source = GetSceneSource(source_path);
+        if (in.Failed() || !source || source->size != size || source->mtime != mtime ||
+            (i == 0 && source->path != scene_source->path)) {
+            return std::nullopt;
+        }
+        if (i > 0) {
+            material_libraries.push_back(std::move(source_path));
+        }
+    }
+
+    std::unordered_map<std::string, Material> materials;
+    std::vector<const Material*> material_pointers;
+    auto material_count = in.ReadCount(sizeof(uint64_t) * 2 + sizeof(double) * 17);
+    for (size_t i = 0; i < material_count; ++i) {
+        auto key = in.ReadString();
+        Material material;
+        material.name = in.ReadString();
+        material.ambient_color = in.ReadVector();
+        material.diffuse_color = in.ReadVector();
+        material.specular_color = in.ReadVector();
+        material.intensity = in.ReadVector();
+        material.specular_exponent = in.Read<double>();
+        material.refraction_index = in.Read<double>();
+        material.albedo = in.ReadVector();
+        auto [it, inserted] = materials.emplace(std::move(key), std::move(material));
+        material_pointers.push_back(&it->second);
+    }
+    // Material of a stored index, nullptr for -1. nullopt for an index the writer can't have
+    // stored, which means the cache is broken.
+    auto read_material = [&]() -> std::optional<const Material*> {
+        auto index = in.Read<int32_t>();
+        if (index < -1 || index >= static_cast<int32_t>(material_pointers.size())) {
+            return std::nullopt;
+        }
+        return index < 0 ? nullptr : material_pointers[index];
+    };
+
+    std::array<std::vector<Vector>, 2> pools;
+    for (auto& pool : pools) {
+        auto count = in.ReadCount(sizeof(double) * 3);
+        pool.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            pool.push_back(in.ReadVector());
+        }
+    }
+    auto triangle_count = in.ReadCount(sizeof(MeshTriangle) + sizeof(int32_t));
+    std::vector<MeshTriangle> triangles;
+    std::vector<const Material*> triangle_materials;
+    triangles.reserve(triangle_count);
+    triangle_materials.reserve(triangle_count);
+    for (size_t i = 0; i < triangle_count; ++i) {
+        auto triangle = in.Read<MeshTriangle>();
+        bool has_normals = triangle.normals[0] != kNoNormal;
+        for (size_t k = 0; k < 3; ++k) {
+            if (triangle.vertexes[k] >= pools[0].size() ||
+                (has_normals && triangle.normals[k] >= pools[1].size())) {
+                return std::nullopt;
+            }
+        }
+        auto material = read_material();
+        if (!material) {
+            return std::nullopt;
+        }
+        triangles.push_back(triangle);
+        triangle_materials.push_back(*material);
+    }
+    Mesh mesh{std::move(pools[0]), std::move(pools[1]), std::move(triangles),
+              std::move(triangle_materials)};
+
+    std::vector<SphereObject> spheres;
+    auto sphere_count = in.ReadCount(sizeof(double) * 4 + sizeof(int32_t));
+    spheres.reserve(sphere_count);
+    for (size_t i = 0; i < sphere_count; ++i) {
+        auto center = in.ReadVector();
+        auto radius = in.Read<double>();
+        auto material = read_material();
+        if (!material) {
+            return std::nullopt;
+        }
+        spheres.emplace_back(Sphere(center, radius), *material);
+    }
+
+    std::vector<Light> lights;
+    auto light_count = in.ReadCount(sizeof(double) * 6);
+    lights.reserve(light_count);
+    for (size_t i = 0; i < light_count; ++i) {
+        auto position = in.ReadVector();
+        auto intensity = in.ReadVector();
+        lights.push_back(Light{position, intensity});
+    }
+
+    if (in.Failed() || !in.AtEnd()) {
+        return std::nullopt;
+    }
+    return Scene{std::move(mesh), std::move(spheres), std::move(lights), std::move(materials),
+                 std::move(material_libraries)};
+}
+
+// ReadScene that keeps a binary cache of the parsed scene in cache_path: a fresh cache is
+// loaded instead of parsing the .obj, a missing or stale one is rewritten after parsing.
+Scene ReadSceneCached(const std::filesystem::path& path, const std::filesystem::path& cache_path) {
+    if (auto scene = ReadSceneCache(path, cache_path)) {
+        return std::move(*scene);
+    }
+    auto scene = ReadScene(path);
+    WriteSceneCache(scene, path, cache_path);
+    return scene;
+}
+
+// Keeps the cache next to the .obj file, e.g. scene.obj.cache.
+Scene ReadSceneCached(const std::filesystem::path& path) {
+    return ReadSceneCached(path, GetSceneCachePath(path));
+}
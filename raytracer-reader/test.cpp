@@ -1,4 +1,5 @@
 #include "scene.h"
+#include "scene_cache.h"
 #include "utils.h"
 #include "../utils/utils.h"
 
@@ -137,3 +138,180 @@ TEST_CASE("Scene") {
     Check(back_wall.albedo, .5, 0., 0.);
     Check(back_wall.diffuse_color, .725, .91, .88);
 }
+
+TEST_CASE("Mesh") {
+    const auto test_dir = GetRelativeDir(__FILE__, "tests");
+    const auto scene = ReadScene(test_dir / "cube.obj");
+    const auto& mesh = scene.GetMesh();
+    REQUIRE(mesh.Size() == 10);
+    CHECK(mesh.GetVertexPool().size() == 24);
+    CHECK(mesh.GetNormalPool().size() == 9);
+
+    const auto& objects = scene.GetObjects();
+    for (size_t i = 0; i < mesh.Size(); ++i) {
+        auto polygon = mesh.GetTriangle(i);
+        auto normals = mesh.GetNormals(i);
+        for (size_t j = 0; j < 3; ++j) {
+            Check(objects[i].polygon[j], polygon[j][0], polygon[j][1], polygon[j][2]);
+            Check(*objects[i].GetNormal(j), normals[j][0], normals[j][1], normals[j][2]);
+        }
+        CHECK(objects[i].material == mesh.GetMaterial(i));
+    }
+
+    const auto copy = scene;
+    CHECK(copy.GetObjects().size() == objects.size());
+}
+
+TEST_CASE("Scene in chunks") {
+    const auto test_dir = GetRelativeDir(__FILE__, "tests");
+    const auto expected = ReadScene(test_dir / "cube.obj");
+    // Tiny chunks put nearly every line of the file into a chunk of its own.
+    const auto scene = ReadScene(test_dir / "cube.obj", 4, 1);
+
+    const auto& objects = scene.GetObjects();
+    const auto& expected_objects = expected.GetObjects();
+    REQUIRE(objects.size() == expected_objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            const auto& p = expected_objects[i].polygon[j];
+            const auto& n = *expected_objects[i].GetNormal(j);
+            Check(objects[i].polygon[j], p[0], p[1], p[2]);
+            Check(*objects[i].GetNormal(j), n[0], n[1], n[2]);
+        }
+        CHECK(objects[i].material->name == expected_objects[i].material->name);
+    }
+
+    const auto& spheres = scene.GetSphereObjects();
+    REQUIRE(spheres.size() == expected.GetSphereObjects().size());
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        CHECK(spheres[i].material->name == expected.GetSphereObjects()[i].material->name);
+    }
+    CHECK(scene.GetLights().size() == expected.GetLights().size());
+    CHECK(scene.GetMaterials().size() == expected.GetMaterials().size());
+}
+
+TEST_CASE("Scene cache") {
+    const auto test_dir = GetRelativeDir(__FILE__, "tests");
+    const auto dir = std::filesystem::temp_directory_path() / "test_raytracer_reader_cache";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    for (const auto* name : {"cube.obj", "CornellBox-Sphere.mtl"}) {
+        std::filesystem::copy_file(test_dir / name, dir / name);
+    }
+    const auto path = dir / "cube.obj";
+    const auto expected = ReadScene(path);
+
+    CHECK_FALSE(ReadSceneCache(path, GetSceneCachePath(path)));
+    ReadSceneCached(path);
+    const auto cached = ReadSceneCache(path, GetSceneCachePath(path));
+    REQUIRE(cached);
+    const auto objects = cached->GetObjects();
+    const auto expected_objects = expected.GetObjects();
+    REQUIRE(objects.size() == expected_objects.size());
+    for (size_t i = 0; i < expected_objects.size(); ++i) {
+        const auto& object = objects[i];
+        const auto& expected_object = expected_objects[i];
+        for (size_t j = 0; j < 3; ++j) {
+            const auto& p = expected_object.polygon[j];
+            const auto& n = *expected_object.GetNormal(j);
+            Check(object.polygon[j], p[0], p[1], p[2]);
+            Check(*object.GetNormal(j), n[0], n[1], n[2]);
+        }
+        CHECK(object.material->name == expected_object.material->name);
+    }
+    REQUIRE(cached->GetSphereObjects().size() == expected.GetSphereObjects().size());
+    for (size_t i = 0; i < expected.GetSphereObjects().size(); ++i) {
+        const auto& sphere = cached->GetSphereObjects()[i];
+        const auto& expected_sphere = expected.GetSphereObjects()[i];
+        CHECK_THAT(sphere.sphere.GetRadius(), WithinAbs(expected_sphere.sphere.GetRadius()));
+        CHECK(sphere.material->name == expected_sphere.material->name);
+    }
+    CHECK(cached->GetLights().size() == expected.GetLights().size());
+    const auto& materials = cached->GetMaterials();
+    REQUIRE(materials.size() == expected.GetMaterials().size());
+    Check(materials.at("backWall").albedo, .5, 0., 0.);
+    CHECK_THAT(materials.at("rightSphere").refraction_index, WithinAbs(1.8));
+
+    // Editing the source makes the cache stale.
+    std::ofstream(path, std::ios::app) << "\nP 0 1 0 1 1 1\n";
+    CHECK_FALSE(ReadSceneCache(path, GetSceneCachePath(path)));
+    CHECK(ReadSceneCached(path).GetLights().size() == expected.GetLights().size() + 1);
+    CHECK(ReadSceneCache(path, GetSceneCachePath(path)));
+
+    // A material index out of range makes the cache broken. The last triangle's index is
+    // followed by the spheres and the lights.
+    {
+        auto cache_path = GetSceneCachePath(path);
+        auto offset = std::filesystem::file_size(cache_path) - sizeof(int32_t) -
+                      2 * sizeof(uint64_t) -
+                      cached->GetSphereObjects().size() * (4 * sizeof(double) + sizeof(int32_t)) -
+                      (expected.GetLights().size() + 1) * 6 * sizeof(double);
+        std::fstream file(cache_path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(offset);
+        auto index = static_cast<int32_t>(materials.size());
+        file.write(reinterpret_cast<const char*>(&index), sizeof(index));
+    }
+    CHECK_FALSE(ReadSceneCache(path, GetSceneCachePath(path)));
+    CHECK(ReadSceneCached(path).GetMesh().GetMaterial(objects.size() - 1));
+    CHECK(ReadSceneCache(path, GetSceneCachePath(path)));
+
+    // A copy of the scene doesn't use the cache that came along with it, which tracks the
+    // original.
+    const auto copy_dir = dir / "copy";
+    std::filesystem::create_directories(copy_dir);
+    for (const auto* name : {"cube.obj", "cube.obj.cache", "CornellBox-Sphere.mtl"}) {
+        std::filesystem::copy_file(dir / name, copy_dir / name);
+    }
+    const auto copy_path = copy_dir / "cube.obj";
+    CHECK_FALSE(ReadSceneCache(copy_path, GetSceneCachePath(copy_path)));
+    std::ofstream(copy_path, std::ios::app) << "P 0 2 0 1 1 1\n";
+    CHECK(ReadSceneCached(copy_path).GetLights().size() == expected.GetLights().size() + 2);
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Instances") {
+    const auto test_dir = GetRelativeDir(__FILE__, "tests");
+    const auto dir = std::filesystem::temp_directory_path() / "test_raytracer_reader_instances";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "models");
+    for (const auto* name : {"cube.obj", "CornellBox-Sphere.mtl"}) {
+        std::filesystem::copy_file(test_dir / name, dir / "models" / name);
+    }
+    std::ofstream(dir / "scene.obj") << "P 0 1 0 1 1 1\n"
+                                     << "I models/cube.obj 1 2 3\n"
+                                     << "I models/../models/cube.obj 0 -2 0 0 2 0 0 0 0 0 2 5\n"
+                                     << "I models/cube.obj -1 0 0\n";
+    const auto scene = ReadSceneCached(dir / "scene.obj");
+    const auto cube = ReadScene(test_dir / "cube.obj");
+
+    CHECK(scene.GetMesh().Size() == 0);
+    CHECK(scene.GetLights().size() == 1);
+    REQUIRE(scene.GetPrototypes().size() == 1);
+    const auto& prototype = scene.GetPrototypes()[0];
+    CHECK(prototype.GetMesh().Size() == cube.GetMesh().Size());
+    CHECK(prototype.GetMaterials().size() == cube.GetMaterials().size());
+    CHECK(prototype.GetMesh().GetMaterial(0)->name == cube.GetMesh().GetMaterial(0)->name);
+
+    const auto& instances = scene.GetInstances();
+    REQUIRE(instances.size() == 3);
+    for (const auto& instance : instances) {
+        CHECK(instance.prototype == 0);
+    }
+    Check(instances[0].transform.ApplyToPoint({1, 1, 1}), 2., 3., 4.);
+    Check(instances[1].transform.ApplyToPoint({1, 1, 1}), -2., 2., 7.);
+    Check(instances[1].inverse.ApplyToPoint({-2, 2, 7}), 1., 1., 1.);
+    Check(instances[2].transform.ApplyToPoint({1, 1, 1}), 0., 1., 1.);
+
+    // Scenes with instances are not cached.
+    CHECK_FALSE(std::filesystem::exists(GetSceneCachePath(dir / "scene.obj")));
+
+    std::ofstream(dir / "nested.obj") << "I scene.obj 0 0 0\n";
+    CHECK_THROWS(ReadScene(dir / "nested.obj"));
+    std::ofstream(dir / "singular.obj") << "I models/cube.obj 1 0 0 0 1 0 0 0 0 0 0 0\n";
+    CHECK_THROWS(ReadScene(dir / "singular.obj"));
+    std::ofstream(dir / "short.obj") << "I models/cube.obj 1 2\n";
+    CHECK_THROWS(ReadScene(dir / "short.obj"));
+
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,272 @@
+#include "options/camera_options.h"
+#include "options/render_options.h"
+#include "raytracer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numbers>
+#include <optional>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Renders the raytracer test scenes at fixed settings and reports the time per frame, traced
+// rays per second and peak memory of each, optionally as JSON for tracking them over time. The
+// time per frame covers tracing and post-processing. Reading the scene and building its BVH are
+// timed apart, so that a slower parser doesn't show up as slower frames.
+// Usage: bench_raytracer [--repetitions N] [--threads N] [--json FILE] [--baseline FILE]
+//                        [--tolerance X]
+// On Linux each scene runs in a process of its own, so that its peak memory is its alone. Scenes
+// are rendered repetitions times and the fastest time of each stage counts. threads defaults to
+// 1, so that numbers from different machines and runs stay comparable. With --baseline, a JSON
+// file written by an earlier run, the exit code is 1 if a scene's frames got more than tolerance
+// (default 0.1) slower.
+
+struct BenchScene {
+    const char* name;
+    const char* obj;
+    CameraOptions camera;
+    int depth;
+};
+
+struct BenchResult {
+    const char* name;
+    double ms_per_frame = kInf;
+    double load_ms = kInf;
+    double build_ms = kInf;
+    double cpu_ms_per_render = kInf;  // of the whole render, with loading and building
+    uint64_t rays = 0;
+    double rays_per_second = 0;
+    int64_t peak_rss_kb = 0;
+};
+
+const std::vector<BenchScene> kScenes = {
+    {"shading_parts", "shading_parts/scene.obj", CameraOptions{640, 480}, 1},
+    {"triangle",
+     "triangle/scene.obj",
+     {.screen_width = 640,
+      .screen_height = 480,
+      .look_from = {0., 2., 0.},
+      .look_to = {0., 0., 0.}},
+     1},
+    {"box",
+     "box/cube.obj",
+     {.screen_width = 640,
+      .screen_height = 480,
+      .fov = std::numbers::pi / 3,
+      .look_from = {0., .7, 1.75},
+      .look_to = {0., .7, 0.}},
+     4},
+    {"classic_box",
+     "classic_box/CornellBox.obj",
+     {.screen_width = 500,
+      .screen_height = 500,
+      .look_from = {-.5, 1.5, .98},
+      .look_to = {0., 1., 0.}},
+     4},
+    {"distorted_box",
+     "distorted_box/CornellBox.obj",
+     {.screen_width = 500,
+      .screen_height = 500,
+      .look_from = {-0.5, 1.5, 1.98},
+      .look_to = {0., 1., 0.}},
+     4},
+    {"mirrors",
+     "mirrors/scene.obj",
+     {.screen_width = 800,
+      .screen_height = 600,
+      .look_from = {2., 1.5, -.1},
+      .look_to = {1., 1.2, -2.8}},
+     9},
+    {"deer",
+     "deer/CERF_Free.obj",
+     {.screen_width = 500,
+      .screen_height = 500,
+      .look_from = {100., 200., 150.},
+      .look_to = {0., 100., 0.}},
+     1},
+};
+
+BenchResult RunScene(const BenchScene& scene, int repetitions, int threads) {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    RenderOptions render_options{scene.depth};
+    render_options.threads = threads;
+
+    BenchResult res{.name = scene.name};
+    auto to_ms = [](auto duration) {
+        return std::chrono::duration<double, std::milli>{duration}.count();
+    };
+    for (int i = 0; i < repetitions; ++i) {
+        Timer timer;
+        auto stats = RenderWithStats(kTestsDir / scene.obj, scene.camera, render_options).stats;
+        auto cpu_time = timer.GetTimes().cpu_time;
+        const auto& rays = stats.rays;
+        res.rays = rays.primary_rays + rays.shadow_rays + rays.reflection_rays +
+                   rays.refraction_rays;
+        res.ms_per_frame = std::min(res.ms_per_frame, to_ms(stats.trace_time + stats.post_time));
+        res.load_ms = std::min(res.load_ms, to_ms(stats.load_time));
+        res.build_ms = std::min(res.build_ms, to_ms(stats.build_time));
+        res.cpu_ms_per_render = std::min(res.cpu_ms_per_render, to_ms(cpu_time));
+    }
+    res.rays_per_second = res.rays / (res.ms_per_frame / 1000);
+#ifdef __linux__
+    res.peak_rss_kb = GetMemoryUsage();
+#endif
+    return res;
+}
+
+#ifdef __linux__
+// RunScene in a child process, so that peak_rss_kb is the peak of this scene alone and not the
+// largest one of all scenes so far.
+BenchResult RunSceneInProcess(const BenchScene& scene, int repetitions, int threads) {
+    static_assert(std::is_trivially_copyable_v<BenchResult>);
+    int fds[2];
+    if (::pipe(fds)) {
+        throw std::system_error{errno, std::generic_category()};
+    }
+    auto pid = ::fork();
+    if (pid < 0) {
+        throw std::system_error{errno, std::generic_category()};
+    }
+    if (pid == 0) {
+        ::close(fds[0]);
+        int code = 1;
+        try {
+            auto res = RunScene(scene, repetitions, threads);
+            if (::write(fds[1], &res, sizeof(res)) == sizeof(res)) {
+                code = 0;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << scene.name << ": " << e.what() << '\n';
+        }
+        ::_exit(code);
+    }
+
+    ::close(fds[1]);
+    BenchResult res;
+    auto size = ::read(fds[0], &res, sizeof(res));
+    ::close(fds[0]);
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+    if (size != sizeof(res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error{std::string{"Rendering "} + scene.name + " failed"};
+    }
+    return res;
+}
+#endif
+
+// One scene per line, so that ReadBaseline can pick them up without a JSON parser.
+void WriteJson(std::ostream& out, const std::vector<BenchResult>& results, int repetitions,
+               int threads) {
+    out << "{\n  \"repetitions\": " << repetitions << ",\n  \"threads\": " << threads
+        << ",\n  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"ms_per_frame\": " << r.ms_per_frame
+            << ", \"load_ms\": " << r.load_ms << ", \"build_ms\": " << r.build_ms
+            << ", \"cpu_ms_per_render\": " << r.cpu_ms_per_render << ", \"rays\": " << r.rays
+            << ", \"rays_per_second\": " << r.rays_per_second
+            << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}" << (i + 1 < results.size() ? "," : "")
+            << '\n';
+    }
+    out << "  ]\n}\n";
+}
+
+// ms_per_frame by scene name from a file written by WriteJson.
+std::map<std::string, double> ReadBaseline(const std::filesystem::path& path) {
+    std::ifstream in{path};
+    if (!in) {
+        throw std::runtime_error{"Can't open baseline " + path.string()};
+    }
+    static const std::regex kScene{R"re("name": "([^"]+)", "ms_per_frame": ([^,]+),)re"};
+    std::map<std::string, double> res;
+    for (std::string line; std::getline(in, line);) {
+        if (std::smatch match; std::regex_search(line, match, kScene)) {
+            res[match[1]] = std::stod(match[2]);
+        }
+    }
+    return res;
+}
+
+int main(int argc, char** argv) {
+    int repetitions = 3;
+    int threads = 1;
+    double tolerance = 0.1;
+    std::optional<std::filesystem::path> json_path, baseline_path;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            std::cerr << "Missing value of " << arg << '\n';
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--repetitions") {
+            repetitions = std::max(1, std::stoi(value));
+        } else if (arg == "--threads") {
+            threads = std::stoi(value);
+        } else if (arg == "--json") {
+            json_path = value;
+        } else if (arg == "--baseline") {
+            baseline_path = value;
+        } else if (arg == "--tolerance") {
+            tolerance = std::stod(value);
+        } else {
+            std::cerr << "Unknown option " << arg << '\n';
+            return 2;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for (const auto& scene : kScenes) {
+#ifdef __linux__
+        const auto& r = results.emplace_back(RunSceneInProcess(scene, repetitions, threads));
+#else
+        const auto& r = results.emplace_back(RunScene(scene, repetitions, threads));
+#endif
+        std::cout << r.name << ": " << r.ms_per_frame << " ms per frame, " << r.load_ms
+                  << " ms load, " << r.build_ms << " ms build (" << r.cpu_ms_per_render
+                  << " ms cpu in all), " << r.rays << " rays, " << r.rays_per_second / 1e6
+                  << " Mrays/s, peak rss " << r.peak_rss_kb / 1024 << " MiB\n";
+    }
+    if (json_path) {
+        std::ofstream out{*json_path};
+        WriteJson(out, results, repetitions, threads);
+        if (!out) {
+            std::cerr << "Can't write " << json_path->string() << '\n';
+            return 2;
+        }
+    }
+
+    if (!baseline_path) {
+        return 0;
+    }
+    auto baseline = ReadBaseline(*baseline_path);
+    bool regressed = false;
+    for (const auto& r : results) {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end()) {
+            continue;
+        }
+        if (r.ms_per_frame > it->second * (1 + tolerance)) {
+            std::cout << "REGRESSION " << r.name << ": " << r.ms_per_frame << " ms per frame, "
+                      << it->second << " in the baseline\n";
+            regressed = true;
+        }
+    }
+    return regressed ? 1 : 0;
+}
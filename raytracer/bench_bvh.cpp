@@ -0,0 +1,63 @@
+#include "bvh.h"
+#include "scene.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Measures BVH construction over the triangles of the given .obj files at every quality level,
+// on one thread and on all of them, and reports the SAH cost of the trees (lower traverses
+// faster). By default runs on the raytracer and raytracer-b2 test scenes.
+// Usage: bench_raytracer_bvh [repetitions] [file.obj...]
+int main(int argc, char** argv) {
+    int repetitions = argc > 1 ? std::stoi(argv[1]) : 5;
+    std::vector<std::filesystem::path> paths(argv + std::min(argc, 2), argv + argc);
+    if (paths.empty()) {
+        for (const auto* dir : {"tests", "../raytracer-b2/tests"}) {
+            const auto tests_dir = GetRelativeDir(__FILE__, dir);
+            for (const auto& entry : std::filesystem::recursive_directory_iterator(tests_dir)) {
+                if (entry.path().extension() == ".obj") {
+                    paths.push_back(entry.path());
+                }
+            }
+        }
+    }
+
+    const std::pair<BVHQuality, const char*> kQualities[] = {
+        {BVHQuality::kFast, "fast"}, {BVHQuality::kMedium, "medium"}, {BVHQuality::kHigh, "high"}};
+    int threads = GetThreadCount(0);
+    for (const auto& path : paths) {
+        auto scene = ReadScene(path);
+        const auto& mesh = scene.GetMesh();
+        std::vector<BoundingBox> bounds;
+        bounds.reserve(mesh.Size());
+        for (size_t i = 0; i < mesh.Size(); ++i) {
+            bounds.push_back(GetBoundingBox(mesh.GetTriangle(i)));
+        }
+        std::cout << path.string() << ": " << bounds.size() << " triangles\n";
+
+        for (const auto& [quality, name] : kQualities) {
+            auto measure = [&](int build_threads) {
+                BVH bvh;
+                Timer timer;
+                for (int i = 0; i < repetitions; ++i) {
+                    bvh = BVH{bounds, {.quality = quality, .threads = build_threads}};
+                }
+                auto [wall_time, cpu_time] = timer.GetTimes();
+                auto spent = std::chrono::duration<double, std::milli>{wall_time} / repetitions;
+                return std::pair{std::move(bvh), spent.count()};
+            };
+            auto [bvh, sequential_time] = measure(1);
+            auto parallel_time = measure(threads).second;
+            std::cout << "  " << name << ": " << sequential_time << " ms on 1 thread, "
+                      << parallel_time << " ms on " << threads << ", " << bvh.NodeCount()
+                      << " nodes, SAH cost " << bvh.GetSahCost() << '\n';
+        }
+    }
+}
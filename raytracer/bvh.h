@@ -0,0 +1,575 @@
+#pragma once
+
+#include "common.h"
+#include "options/render_options.h"
+#include "ray.h"
+#include "sphere.h"
+#include "thread_pool.h"
+#include "triangle.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+const double kInf = std::numeric_limits<double>::infinity();
+
+struct BoundingBox {
+    Vector min{kInf, kInf, kInf};
+    Vector max{-kInf, -kInf, -kInf};
+
+    void Extend(const Vector& p) {
+        for (int i = 0; i < 3; ++i) {
+            min[i] = std::min(min[i], p[i]);
+            max[i] = std::max(max[i], p[i]);
+        }
+    }
+
+    // An empty box leaves the box as it is. Extending by its infinite corners would make the
+    // box infinite instead, and with it the SAH cost of every split next to an empty bin.
+    void Extend(const BoundingBox& b) {
+        if (b.Empty()) {
+            return;
+        }
+        Extend(b.min);
+        Extend(b.max);
+    }
+
+    // Grows the box so that intersections accepted within kEps tolerance stay inside it.
+    void Pad() {
+        double extent = 0;
+        for (int i = 0; i < 3; ++i) {
+            extent = std::max(extent, max[i] - min[i]);
+        }
+        double pad = 10 * kEps * (1 + extent);
+        min -= Vector(pad, pad, pad);
+        max += Vector(pad, pad, pad);
+    }
+
+    bool Empty() const {
+        return min[0] > max[0];
+    }
+
+    Vector Center() const {
+        return (min + max) * 0.5;
+    }
+
+    double Area() const {
+        if (Empty()) {
+            return 0;
+        }
+        Vector d = max - min;
+        return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+};
+
+BoundingBox GetBoundingBox(const Triangle& triangle) {
+    BoundingBox box;
+    for (size_t i = 0; i < 3; ++i) {
+        box.Extend(triangle[i]);
+    }
+    box.Pad();
+    return box;
+}
+
+// Intersections with a sphere are accepted within kEps tolerance on the discriminant, which
+// admits rays passing up to sqrt(r * r + kEps / 4) from the center.
+BoundingBox GetBoundingBox(const Sphere& sphere) {
+    double r = std::sqrt(sphere.GetRadius() * sphere.GetRadius() + kEps);
+    BoundingBox box;
+    box.Extend(sphere.GetCenter() - Vector(r, r, r));
+    box.Extend(sphere.GetCenter() + Vector(r, r, r));
+    box.Pad();
+    return box;
+}
+
+// Distance at which the ray enters the box, nullopt if it misses the box or enters it farther
+// than max_distance. A ray starting inside the box enters it at distance 0.
+std::optional<double> GetEntryDistance(const Ray& ray, const BoundingBox& box,
+                                       double max_distance) {
+    const Vector& o = ray.GetOrigin();
+    const Vector& inv = ray.GetInverseDirection();
+    double tnear = 0;
+    double tfar = max_distance;
+    for (size_t i = 0; i < 3; ++i) {
+        // The near side of the slab is the max side for a ray going backwards on the axis. For a
+        // zero component the inverse is infinite, and the distances are -inf and inf if the
+        // origin is between the sides and the same infinity otherwise, so it works out without
+        // a special case. An origin right on a side gives NaN, which max and min below ignore.
+        double t0 = ((ray.GetSign(i) ? box.max[i] : box.min[i]) - o[i]) * inv[i];
+        double t1 = ((ray.GetSign(i) ? box.min[i] : box.max[i]) - o[i]) * inv[i];
+        tnear = std::max(tnear, t0);
+        tfar = std::min(tfar, t1);
+        if (tnear > tfar) {
+            return std::nullopt;
+        }
+    }
+    return tnear;
+}
+
+// How a BVH is built. Quality levels:
+//   kFast    linear BVH: primitives are sorted by the Morton codes of their centers and ranges
+//            are split where the highest differing bit of the codes flips, no cost estimates
+//   kMedium  binned surface area heuristic with 16 bins per axis
+//   kHigh    the same with 64 bins, slower to build and a little cheaper to traverse
+struct BVHOptions {
+    BVHQuality quality = BVHQuality::kMedium;
+    // Ranges of at most this many primitives are never split, which suits callers that test a
+    // leaf's primitives in packets of that size.
+    size_t min_leaf_size = 1;
+    int threads = 1;  // 0 means one per hardware thread
+};
+
+// Bounding volume hierarchy over an indexed set of primitives. The hierarchy only knows
+// primitive bounds, the actual intersection test is done by the caller in the visitor passed to
+// Traverse. Leaves are numbered densely, so callers can keep their own per-leaf data (e.g.
+// packed primitives) in a plain vector.
+//
+// The build is parallel: large ranges near the root are split one at a time with their binning
+// spread over the threads, the subtrees below are built independently and appended in a fixed
+// order. The tree doesn't depend on the number of threads.
+class BVH {
+public:
+    static constexpr size_t kMaxLeafSize = 4;
+
+    BVH() = default;
+
+    explicit BVH(const std::vector<BoundingBox>& bounds, const BVHOptions& options = {})
+        : options_(options) {
+        Build(bounds);
+    }
+
+    // Visits leaves front to back, calling visit(leaf, max_distance) for every leaf the ray
+    // enters closer than max_distance. The visitor shrinks
+    // max_distance when it finds a closer hit, which prunes the rest of the traversal, and
+    // returns true to stop the traversal altogether. Returns the number of nodes visited.
+    template <class Visitor>
+    size_t Traverse(const Ray& ray, double& max_distance, Visitor&& visit) const {
+        if (nodes_.empty() || !GetEntryDistance(ray, nodes_[0].box, max_distance)) {
+            return 0;
+        }
+
+        std::array<std::pair<uint32_t, double>, kMaxDepth + 2> stack;
+        size_t size = 0;
+        stack[size++] = {0, 0.0};
+        size_t visited = 0;
+        while (size > 0) {
+            auto [index, entry] = stack[--size];
+            if (entry > max_distance) {
+                continue;
+            }
+            ++visited;
+            const Node& node = nodes_[index];
+            if (node.count > 0) {
+                if (visit(node.first, max_distance)) {
+                    return visited;
+                }
+                continue;
+            }
+
+            auto left = GetEntryDistance(ray, nodes_[node.first].box, max_distance);
+            auto right = GetEntryDistance(ray, nodes_[node.first + 1].box, max_distance);
+            if (left && right) {
+                if (*left <= *right) {
+                    stack[size++] = {node.first + 1, *right};
+                    stack[size++] = {node.first, *left};
+                } else {
+                    stack[size++] = {node.first, *left};
+                    stack[size++] = {node.first + 1, *right};
+                }
+            } else if (left) {
+                stack[size++] = {node.first, *left};
+            } else if (right) {
+                stack[size++] = {node.first + 1, *right};
+            }
+        }
+        return visited;
+    }
+
+    // Indices of the primitives stored in the leaf.
+    std::span<const uint32_t> GetLeaf(uint32_t leaf) const {
+        return std::span{order_}.subspan(leaf_offsets_[leaf], leaf_offsets_[leaf + 1] -
+                                                                  leaf_offsets_[leaf]);
+    }
+
+    size_t LeafCount() const {
+        return leaf_offsets_.empty() ? 0 : leaf_offsets_.size() - 1;
+    }
+
+    size_t NodeCount() const {
+        return nodes_.size();
+    }
+
+    // Box around all primitives, empty if there are none.
+    BoundingBox GetBounds() const {
+        return nodes_.empty() ? BoundingBox{} : nodes_[0].box;
+    }
+
+    // Surface area heuristic estimate of the cost of a ray against the tree: the area of every
+    // node relative to the root's, times one for inner nodes and times the primitive count for
+    // leaves. Lower is better, 0 for an empty tree.
+    double GetSahCost() const {
+        if (nodes_.empty() || nodes_[0].box.Area() == 0) {
+            return 0;
+        }
+        double cost = 0;
+        for (const auto& node : nodes_) {
+            cost += node.box.Area() * (node.count > 0 ? node.count : 1);
+        }
+        return cost / nodes_[0].box.Area();
+    }
+
+private:
+    static constexpr size_t kMaxDepth = 48;
+    static constexpr int kBins = 16;
+    static constexpr int kMaxBins = 64;
+    // Ranges up to this size are built as independent subtrees.
+    static constexpr uint32_t kSubtreeSize = 1 << 12;
+    // Larger ranges are binned in chunks of this size in parallel.
+    static constexpr uint32_t kChunkSize = 1 << 14;
+
+    struct Node {
+        BoundingBox box;
+        // Leaf: leaf number and primitive count. Inner node: children first, first + 1.
+        uint32_t first = 0;
+        uint32_t count = 0;
+    };
+
+    struct Split {
+        int axis = -1;
+        int bin = 0;
+        double cost = kInf;
+    };
+
+    struct Task {
+        uint32_t node;
+        uint32_t begin;
+        uint32_t end;
+        size_t depth;
+    };
+
+    // Per primitive data that is only needed during the build.
+    struct BuildInput {
+        const std::vector<BoundingBox>& bounds;
+        std::vector<Vector> centers;
+        std::vector<uint32_t> codes;  // Morton codes in order_ order, kFast only
+    };
+
+    // Boxes and primitive counts of the bins of all three axes, bin b of axis a at a * bins + b.
+    struct Bins {
+        std::vector<BoundingBox> boxes;
+        std::vector<uint32_t> counts;
+
+        void Merge(const Bins& other) {
+            for (size_t i = 0; i < boxes.size(); ++i) {
+                boxes[i].Extend(other.boxes[i]);
+                counts[i] += other.counts[i];
+            }
+        }
+    };
+
+    int GetBinCount() const {
+        return options_.quality == BVHQuality::kHigh ? kMaxBins : kBins;
+    }
+
+    // func(begin, end) for chunks of [begin, end), in parallel if there is more than one.
+    // Returns the results in chunk order.
+    template <class Func>
+    auto MapChunks(uint32_t begin, uint32_t end, Func&& func) const {
+        size_t chunks = (end - begin + kChunkSize - 1) / kChunkSize;
+        std::vector<decltype(func(begin, end))> results(chunks);
+        ParallelFor(chunks, options_.threads, [&](size_t i) {
+            auto chunk_begin = static_cast<uint32_t>(begin + i * kChunkSize);
+            results[i] = func(chunk_begin, std::min(end, chunk_begin + kChunkSize));
+        });
+        return results;
+    }
+
+    // func(begin, end) for chunks of [begin, end), in parallel if there is more than one.
+    template <class Func>
+    void ForEachChunk(uint32_t begin, uint32_t end, Func&& func) const {
+        MapChunks(begin, end, [&](uint32_t chunk_begin, uint32_t chunk_end) {
+            func(chunk_begin, chunk_end);
+            return 0;
+        });
+    }
+
+    void Build(const std::vector<BoundingBox>& bounds) {
+        if (bounds.empty()) {
+            return;
+        }
+        auto size = static_cast<uint32_t>(bounds.size());
+        BuildInput input{bounds, std::vector<Vector>(size), {}};
+        order_.resize(size);
+        ForEachChunk(0, size, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                input.centers[i] = bounds[i].Center();
+                order_[i] = i;
+            }
+        });
+        if (options_.quality == BVHQuality::kFast) {
+            SortByMortonCode(input);
+        }
+
+        nodes_.reserve(2 * bounds.size());
+        nodes_.emplace_back();
+        std::vector<Task> leaves;
+        std::vector<Task> subtrees;
+        Grow(input, {{0, 0, size, 0}}, nodes_, leaves, &subtrees);
+
+        std::vector<std::vector<Node>> subtree_nodes(subtrees.size());
+        std::vector<std::vector<Task>> subtree_leaves(subtrees.size());
+        ParallelFor(subtrees.size(), options_.threads, [&](size_t i) {
+            const auto& task = subtrees[i];
+            subtree_nodes[i].emplace_back();
+            Grow(input, {{0, task.begin, task.end, task.depth}}, subtree_nodes[i],
+                 subtree_leaves[i], nullptr);
+        });
+
+        // The root of a subtree goes to the node reserved for it, the rest is appended. Child
+        // indices in a subtree start from 1, so a node with first > 0 is an inner one there.
+        for (size_t i = 0; i < subtrees.size(); ++i) {
+            auto base = static_cast<uint32_t>(nodes_.size());
+            auto place = [&](uint32_t local) {
+                return local == 0 ? subtrees[i].node : base + local - 1;
+            };
+            for (size_t j = 0; j < subtree_nodes[i].size(); ++j) {
+                Node node = subtree_nodes[i][j];
+                if (node.first > 0) {
+                    node.first = place(node.first);
+                }
+                if (j == 0) {
+                    nodes_[subtrees[i].node] = node;
+                } else {
+                    nodes_.push_back(node);
+                }
+            }
+            for (auto leaf : subtree_leaves[i]) {
+                leaf.node = place(leaf.node);
+                leaves.push_back(leaf);
+            }
+        }
+
+        // Number leaves in primitive order, so leaf i covers order_[offsets[i], offsets[i + 1]).
+        std::ranges::sort(leaves, {}, &Task::begin);
+        for (const auto& leaf : leaves) {
+            nodes_[leaf.node].first = static_cast<uint32_t>(leaf_offsets_.size());
+            nodes_[leaf.node].count = leaf.end - leaf.begin;
+            leaf_offsets_.push_back(leaf.begin);
+        }
+        leaf_offsets_.push_back(size);
+    }
+
+    // Splits the tasks down to leaves, adding the nodes to nodes. If subtrees is set, tasks of
+    // at most kSubtreeSize primitives are set aside there instead.
+    void Grow(BuildInput& input, std::vector<Task> tasks, std::vector<Node>& nodes,
+              std::vector<Task>& leaves, std::vector<Task>* subtrees) {
+        while (!tasks.empty()) {
+            Task task = tasks.back();
+            tasks.pop_back();
+            if (subtrees && task.end - task.begin <= kSubtreeSize) {
+                subtrees->push_back(task);
+                continue;
+            }
+
+            auto boxes = MapChunks(task.begin, task.end, [&](uint32_t begin, uint32_t end) {
+                std::pair<BoundingBox, BoundingBox> res;
+                for (uint32_t i = begin; i < end; ++i) {
+                    res.first.Extend(input.bounds[order_[i]]);
+                    res.second.Extend(input.centers[order_[i]]);
+                }
+                return res;
+            });
+            BoundingBox box, centroid_box;
+            for (const auto& [chunk_box, chunk_centroid_box] : boxes) {
+                box.Extend(chunk_box);
+                centroid_box.Extend(chunk_centroid_box);
+            }
+            nodes[task.node].box = box;
+
+            auto mid = options_.quality == BVHQuality::kFast
+                           ? SplitByMortonCode(input, task)
+                           : SplitRange(input, task, box, centroid_box);
+            if (!mid) {
+                leaves.push_back(task);
+                continue;
+            }
+
+            auto children = static_cast<uint32_t>(nodes.size());
+            nodes[task.node].first = children;
+            nodes.emplace_back();
+            nodes.emplace_back();
+            tasks.push_back({children, task.begin, *mid, task.depth + 1});
+            tasks.push_back({children + 1, *mid, task.end, task.depth + 1});
+        }
+    }
+
+    bool IsLeaf(const Task& task) const {
+        return task.end - task.begin <= std::max<size_t>(1, options_.min_leaf_size) ||
+               task.depth >= kMaxDepth;
+    }
+
+    // Partitions order_[begin, end) and returns the split position, nullopt for a leaf.
+    std::optional<uint32_t> SplitRange(const BuildInput& input, const Task& task,
+                                       const BoundingBox& box, const BoundingBox& centroid_box) {
+        uint32_t count = task.end - task.begin;
+        if (IsLeaf(task)) {
+            return std::nullopt;
+        }
+
+        int bins = GetBinCount();
+        auto chunk_bins = MapChunks(task.begin, task.end, [&](uint32_t begin, uint32_t end) {
+            Bins res{std::vector<BoundingBox>(3 * bins), std::vector<uint32_t>(3 * bins)};
+            for (uint32_t i = begin; i < end; ++i) {
+                const auto& center = input.centers[order_[i]];
+                const auto& bounds = input.bounds[order_[i]];
+                for (int axis = 0; axis < 3; ++axis) {
+                    int bin = axis * bins + GetBin(center[axis], centroid_box.min[axis],
+                                                   centroid_box.max[axis], bins);
+                    res.boxes[bin].Extend(bounds);
+                    ++res.counts[bin];
+                }
+            }
+            return res;
+        });
+        for (size_t i = 1; i < chunk_bins.size(); ++i) {
+            chunk_bins[0].Merge(chunk_bins[i]);
+        }
+
+        Split best;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!(centroid_box.max[axis] > centroid_box.min[axis])) {
+                continue;
+            }
+            const auto* bin_boxes = chunk_bins[0].boxes.data() + axis * bins;
+            const auto* bin_counts = chunk_bins[0].counts.data() + axis * bins;
+
+            std::array<double, kMaxBins> right_costs;
+            BoundingBox right_box;
+            uint32_t right_count = 0;
+            for (int bin = bins - 1; bin > 0; --bin) {
+                right_box.Extend(bin_boxes[bin]);
+                right_count += bin_counts[bin];
+                right_costs[bin] = right_box.Area() * right_count;
+            }
+            BoundingBox left_box;
+            uint32_t left_count = 0;
+            for (int bin = 1; bin < bins; ++bin) {
+                left_box.Extend(bin_boxes[bin - 1]);
+                left_count += bin_counts[bin - 1];
+                double cost = left_box.Area() * left_count + right_costs[bin];
+                if (left_count > 0 && left_count < count && cost < best.cost) {
+                    best = {axis, bin, cost};
+                }
+            }
+        }
+
+        double leaf_cost = box.Area() * count;
+        if (best.axis < 0) {
+            if (count <= kMaxLeafSize) {
+                return std::nullopt;
+            }
+            // All centroids coincide, any split is as good as the other.
+            return task.begin + count / 2;
+        }
+        if (count <= kMaxLeafSize && best.cost >= leaf_cost) {
+            return std::nullopt;
+        }
+
+        double lo = centroid_box.min[best.axis];
+        double hi = centroid_box.max[best.axis];
+        auto mid = std::partition(order_.begin() + task.begin, order_.begin() + task.end,
+                                  [&](uint32_t index) {
+                                      return GetBin(input.centers[index][best.axis], lo, hi,
+                                                    bins) < best.bin;
+                                  });
+        return static_cast<uint32_t>(mid - order_.begin());
+    }
+
+    // Split of a range sorted by Morton code: the codes of a range share their bits above the
+    // highest one that differs between its first and last code, the split is where it flips.
+    std::optional<uint32_t> SplitByMortonCode(const BuildInput& input, const Task& task) const {
+        uint32_t count = task.end - task.begin;
+        if (IsLeaf(task) || count <= kMaxLeafSize) {
+            return std::nullopt;
+        }
+        uint32_t first = input.codes[task.begin];
+        uint32_t last = input.codes[task.end - 1];
+        if (first == last) {
+            return task.begin + count / 2;
+        }
+        uint32_t bit = uint32_t{1} << (std::bit_width(first ^ last) - 1);
+        auto mid = std::partition_point(input.codes.begin() + task.begin,
+                                        input.codes.begin() + task.end,
+                                        [&](uint32_t code) { return (code & bit) == 0; });
+        return static_cast<uint32_t>(mid - input.codes.begin());
+    }
+
+    // Sorts order_ by the 30-bit Morton codes of the centers within their bounding box, ties by
+    // index, and stores the sorted codes in input.codes.
+    void SortByMortonCode(BuildInput& input) {
+        auto size = static_cast<uint32_t>(order_.size());
+        auto boxes = MapChunks(0, size, [&](uint32_t begin, uint32_t end) {
+            BoundingBox res;
+            for (uint32_t i = begin; i < end; ++i) {
+                res.Extend(input.centers[i]);
+            }
+            return res;
+        });
+        BoundingBox centroid_box;
+        for (const auto& chunk_box : boxes) {
+            centroid_box.Extend(chunk_box);
+        }
+
+        std::vector<uint64_t> keys(size);
+        ForEachChunk(0, size, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                uint32_t code = 0;
+                for (int axis = 0; axis < 3; ++axis) {
+                    auto cell = static_cast<uint32_t>(GetBin(input.centers[i][axis],
+                                                             centroid_box.min[axis],
+                                                             centroid_box.max[axis], 1 << 10));
+                    code |= SpreadBits(cell) << (2 - axis);
+                }
+                keys[i] = (uint64_t{code} << 32) | i;
+            }
+        });
+        std::ranges::sort(keys);
+        input.codes.resize(size);
+        for (uint32_t i = 0; i < size; ++i) {
+            input.codes[i] = static_cast<uint32_t>(keys[i] >> 32);
+            order_[i] = static_cast<uint32_t>(keys[i]);
+        }
+    }
+
+    // Moves bit k of a 10-bit number to bit 3k.
+    static uint32_t SpreadBits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    }
+
+    // Bin of x among bins equal parts of [lo, hi], 0 if the range is empty.
+    static int GetBin(double x, double lo, double hi, int bins) {
+        if (!(hi > lo)) {
+            return 0;
+        }
+        auto bin = static_cast<int>(bins * (x - lo) / (hi - lo));
+        return std::clamp(bin, 0, bins - 1);
+    }
+
+    BVHOptions options_;
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> order_;
+    std::vector<uint32_t> leaf_offsets_;
+};
@@ -2,104 +2,239 @@
 #include <cassert>
 #include <cmath>
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <filesystem>
 #include <vector>
 
 #include "image.h"
+#include "thread_pool.h"
 
 struct FloatingRGB {
     double r, g, b;
 };
+
+// Image with double precision channels, stored as three planes (all reds, then all greens, then
+// all blues) so the per-channel passes below run over contiguous arrays the compiler can
+// vectorize.
 class FloatingImage {
 
 public:
-    FloatingImage(int width, int height) : width_(width), height_(height), data_(width * height) {
+    FloatingImage(int width, int height)
+        : width_(width),
+          height_(height),
+          planes_{std::vector<double>(width * height), std::vector<double>(width * height),
+                  std::vector<double>(width * height)} {
+    }
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
     }
-    FloatingRGB GetPixel(int i, int j) {
+
+    FloatingRGB GetPixel(int i, int j) const {
         assert(0 <= i && i < height_ && "out of bounds");
         assert(0 <= j && j < width_ && "out of bounds");
-        return data_[i * width_ + j];
+        size_t index = i * width_ + j;
+        return FloatingRGB{planes_[0][index], planes_[1][index], planes_[2][index]};
     }
 
     void SetPixel(int i, int j, FloatingRGB x) {
         assert(0 <= i && i < height_ && "out of bounds");
         assert(0 <= j && j < width_ && "out of bounds");
-        data_[i * width_ + j] = x;
+        size_t index = i * width_ + j;
+        planes_[0][index] = x.r;
+        planes_[1][index] = x.g;
+        planes_[2][index] = x.b;
     }
 
     void ToneMapping() {
-        double c = 0;
-        for (int i = 0; i < height_; ++i) {
-            for (int j = 0; j < width_; ++j) {
-                FloatingRGB fx = data_[i * width_ + j];
-                c = std::max({c, fx.r, fx.g, fx.b});
-            }
-        }
+        double c = GetMax(1);
         c *= c;
-        for (int i = 0; i < height_; ++i) {
-            for (int j = 0; j < width_; ++j) {
-                FloatingRGB fx = data_[i * width_ + j];
-                auto tone_map = [&c](double x) { return x * (1 + x / c) / (1 + x); };
-                data_[i * width_ + j] = FloatingRGB{
-                    tone_map(fx.r),
-                    tone_map(fx.g),
-                    tone_map(fx.b),
-                };
+        for (auto& plane : planes_) {
+            for (double& x : plane) {
+                x = ToneMap(x, c);
             }
         }
     }
 
     void GammaCorrection() {
-        for (int i = 0; i < height_; ++i) {
-            for (int j = 0; j < width_; ++j) {
-                FloatingRGB fx = data_[i * width_ + j];
-                auto gamma = [](double x) { return pow(x, 1.0 / 2.2); };
-                data_[i * width_ + j] = FloatingRGB{
-                    gamma(fx.r),
-                    gamma(fx.g),
-                    gamma(fx.b),
-                };
+        for (auto& plane : planes_) {
+            for (double& x : plane) {
+                x = pow(x, 1.0 / 2.2);
             }
         }
     }
 
-    Image ToImage() {
+    Image ToImage(int threads = 1) const {
         Image post(width_, height_);
-        for (int i = 0; i < height_; ++i) {
+        ParallelFor(height_, threads, [&](size_t i) {
             for (int j = 0; j < width_; ++j) {
-                FloatingRGB fx = data_[i * width_ + j];
-                int r = 255 * ((std::isnan(fx.r) || std::isinf(fx.r)) ? 0.0 : fx.r);
-                if (r > 255) {
-                    r = 255;
-                }
-                if (r < 0) {
-                    r = 0;
-                }
-                int g = 255 * ((std::isnan(fx.g) || std::isinf(fx.g)) ? 0.0 : fx.g);
-                if (g > 255) {
-                    g = 255;
-                }
-                if (g < 0) {
-                    g = 0;
-                }
-                int b = 255 * ((std::isnan(fx.b) || std::isinf(fx.b)) ? 0.0 : fx.b);
-                if (b > 255) {
-                    b = 255;
-                }
-                if (b < 0) {
-                    b = 0;
-                }
-                assert(0 <= r && r <= 255);
-                assert(0 <= g && g <= 255);
-                assert(0 <= b && b <= 255);
+                size_t index = i * width_ + j;
+                post.SetPixel({Quantize(planes_[0][index]), Quantize(planes_[1][index]),
+                               Quantize(planes_[2][index])},
+                              i, j);
+            }
+        });
+        return post;
+    }
 
-                post.SetPixel({r, g, b}, i, j);
+    // Same as ToneMapping, GammaCorrection and ToImage in a row, but done in a single pass over
+    // the pixels after finding the maximum, parallel across rows, and without calling pow: the
+    // gamma curve is applied through a table of the exact thresholds between output levels.
+    Image ToDisplayImage(int threads = 1) const {
+        double c = GetMax(threads);
+        c *= c;
+        Image post(width_, height_);
+        ParallelFor(height_, threads, [&](size_t i) {
+            for (int j = 0; j < width_; ++j) {
+                size_t index = i * width_ + j;
+                post.SetPixel({GammaQuantize(ToneMap(planes_[0][index], c)),
+                               GammaQuantize(ToneMap(planes_[1][index], c)),
+                               GammaQuantize(ToneMap(planes_[2][index], c))},
+                              i, j);
             }
-        }
+        });
         return post;
     }
 
+    // ToImage().Write(path) without building the image: rows are quantized and written out a
+    // strip at a time, so only a strip of them is held in 8bit form.
+    void WriteImage(const std::filesystem::path& path, int threads = 1) const {
+        PngWriter writer{path, width_, height_};
+        AppendImageRows(writer, threads);
+        writer.Finish();
+    }
+
+    // ToDisplayImage().Write(path) the same way. The tone map needs the maximum of the whole
+    // image, so it takes a pass to find it before the one that writes.
+    void WriteDisplayImage(const std::filesystem::path& path, int threads = 1) const {
+        PngWriter writer{path, width_, height_};
+        AppendDisplayRows(writer, GetMax(threads), threads);
+        writer.Finish();
+    }
+
+    // Rows of WriteImage appended to a png that is being written, so that an image can also be
+    // written from a series of images holding a strip of its rows each.
+    void AppendImageRows(PngWriter& writer, int threads = 1) const {
+        WriteRows(writer, threads, [](double x) { return Quantize(x); });
+    }
+
+    // Rows of WriteDisplayImage for an image whose largest channel value is max.
+    void AppendDisplayRows(PngWriter& writer, double max, int threads = 1) const {
+        double c = max * max;
+        WriteRows(writer, threads, [c](double x) { return GammaQuantize(ToneMap(x, c)); });
+    }
+
+    // Largest channel value of the image, 0 for an all-black one.
+    double GetMax(int threads = 1) const {
+        std::vector<double> row_max(height_);
+        ParallelFor(height_, threads, [&](size_t i) {
+            double c = 0;
+            for (const auto& plane : planes_) {
+                for (int j = 0; j < width_; ++j) {
+                    c = std::max(c, plane[i * width_ + j]);
+                }
+            }
+            row_max[i] = c;
+        });
+        double c = 0;
+        for (double x : row_max) {
+            c = std::max(c, x);
+        }
+        return c;
+    }
+
+    // Rows the png writers quantize at a time.
+    static constexpr int kStripRows = 32;
+
 private:
+    // Converts the rows of a strip in parallel with quantize and hands them to the png writer.
+    template <class Quantize>
+    void WriteRows(PngWriter& writer, int threads, Quantize&& quantize) const {
+        std::vector<png_byte> strip(static_cast<size_t>(std::min(kStripRows, height_)) * 4 *
+                                    width_);
+        for (int begin = 0; begin < height_; begin += kStripRows) {
+            int rows = std::min(kStripRows, height_ - begin);
+            ParallelFor(rows, threads, [&](size_t k) {
+                png_byte* row = strip.data() + k * 4 * width_;
+                size_t index = (begin + k) * width_;
+                for (int j = 0; j < width_; ++j, ++index) {
+                    row[4 * j] = quantize(planes_[0][index]);
+                    row[4 * j + 1] = quantize(planes_[1][index]);
+                    row[4 * j + 2] = quantize(planes_[2][index]);
+                    row[4 * j + 3] = 255;
+                }
+            });
+            for (int k = 0; k < rows; ++k) {
+                writer.WriteRow(strip.data() + static_cast<size_t>(k) * 4 * width_);
+            }
+        }
+    }
+
+    static double ToneMap(double x, double c) {
+        return x * (1 + x / c) / (1 + x);
+    }
+
+    // Output level of a channel value in [0, 1], NaN and infinity give 0.
+    static int Quantize(double x) {
+        int v = 255 * ((std::isnan(x) || std::isinf(x)) ? 0.0 : x);
+        return std::clamp(v, 0, 255);
+    }
+
+    // Quantize(pow(x, 1 / 2.2)) without the pow.
+    static int GammaQuantize(double x) {
+        if (!(x >= 0) || std::isinf(x)) {
+            return 0;
+        }
+        if (x >= 1) {
+            return 255;
+        }
+        static const GammaTable kTable;
+        // Multiplying by a power of two is exact, so x is never below its bucket's start.
+        int level = kTable.bucket_levels[static_cast<size_t>(x * GammaTable::kBuckets)];
+        while (level < 255 && x >= kTable.thresholds[level]) {
+            ++level;
+        }
+        return level;
+    }
+
+    // thresholds[k - 1] is the smallest x in [0, 1] with Quantize(pow(x, 1 / 2.2)) >= k, found by
+    // bisection over the bit patterns of doubles, which are ordered like the non-negative
+    // values they encode. bucket_levels[b] is the level of b / kBuckets, the level of any x in
+    // the bucket is at most a few thresholds above it, and most often equal.
+    struct GammaTable {
+        static constexpr int kBuckets = 1 << 12;
+
+        std::array<double, 255> thresholds;
+        std::array<uint8_t, kBuckets> bucket_levels;
+
+        GammaTable() {
+            for (int k = 1; k <= 255; ++k) {
+                auto lo = std::bit_cast<uint64_t>(0.0);
+                auto hi = std::bit_cast<uint64_t>(1.0);
+                while (lo < hi) {
+                    auto mid = lo + (hi - lo) / 2;
+                    if (Quantize(pow(std::bit_cast<double>(mid), 1.0 / 2.2)) >= k) {
+                        hi = mid;
+                    } else {
+                        lo = mid + 1;
+                    }
+                }
+                thresholds[k - 1] = std::bit_cast<double>(lo);
+            }
+            for (int b = 0; b < kBuckets; ++b) {
+                double x = static_cast<double>(b) / kBuckets;
+                bucket_levels[b] = std::upper_bound(thresholds.begin(), thresholds.end(), x) -
+                                   thresholds.begin();
+            }
+        }
+    };
+
     int width_;
     int height_;
-    std::vector<FloatingRGB> data_;
+    std::array<std::vector<double>, 3> planes_;
 };
@@ -1,8 +1,48 @@
 #pragma once
 
-enum class RenderMode { kDepth, kNormal, kFull };
+#include <vector>
+
+enum class RenderMode { kDepth, kNormal, kFull, kAlbedo };
+
+// Time spent building a BVH against how fast it is to traverse, see BVHOptions.
+enum class BVHQuality { kFast, kMedium, kHigh };
+
+// When reflected and refracted rays stop being followed. The weight of a ray is the product of
+// the albedos along its path, the factor its color adds to the pixel with.
+struct RayTermination {
+    // Rays lighter than this aren't traced, 0 traces all of them up to the render depth.
+    double min_weight = 0;
+    // Instead of dropping a ray under min_weight, trace it with probability weight / min_weight
+    // and count it with weight min_weight, which keeps the expected color at the cost of noise.
+    // The draw depends only on the path of the ray, so renders are reproducible.
+    bool russian_roulette = false;
+};
 
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    int threads = 0;  // 0 means one per hardware thread
+    // Modes RenderOutputs produces from a single traversal, just mode if empty.
+    std::vector<RenderMode> outputs = {};
+    // Keep a binary cache of the parsed scene next to the .obj (scene.obj.cache) and load it
+    // instead of parsing while the .obj and .mtl files are unchanged.
+    bool scene_cache = false;
+    // Adaptive anti-aliasing of full renders. After one sample per pixel, pixels that differ
+    // from a neighbour by more than aa_threshold (in any channel, with colors x compressed to
+    // x / (1 + x)) are traced again with aa_samples stratified sub-samples, rounded up to a
+    // square grid. At most aa_budget of all pixels are refined, the most contrasting first.
+    // Off while aa_samples is at most 1.
+    int aa_samples = 0;
+    double aa_threshold = 0.1;
+    double aa_budget = 0.25;
+    // Trace full renders as a wavefront: ray by ray generation in sorted batches instead of
+    // pixel by pixel, see TraceWavefront.
+    bool wavefront = false;
+    // Intersect triangles with packets of floats: half the memory and twice the triangles per
+    // SIMD instruction. Hits are confirmed in double precision, so the image is the same as with
+    // double geometry except where float rounding misses a triangle at a grazing angle.
+    bool float_geometry = false;
+    // BVH construction quality. BVHs are built on threads workers too.
+    BVHQuality bvh_quality = BVHQuality::kMedium;
+    RayTermination termination = {};
 };
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bvh.h"
 #include "geometry.h"
 #include "material.h"
 #include "object.h"
@@ -8,28 +9,32 @@
 #include "image.h"
 #include "floating_image.h"
 #include "ray.h"
+#include "render_stats.h"
 #include "common.h"
 #include "scene.h"
+#include "scene_cache.h"
+#include "sphere_packet.h"
+#include "thread_pool.h"
+#include "transform.h"
+#include "triangle_packet.h"
 #include "vector.h"
 
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
 #include <filesystem>
 #include <filesystem>
+#include <functional>
+#include <map>
+#include <limits>
 #include <optional>
-// #include <chrono>
-
-// std::chrono::steady_clock::time_point start, last;
-// void bench(const std::string& label = "") {
-//     auto now = std::chrono::steady_clock::now();
-//
-//
-//               << std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count()
-//               << "[ns]) ";
-//
-//               << std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count()
-//               << "[ns])\n";
-//     last = now;
-// }
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 struct PreparedCameraOptions {
     CameraOptions options;
@@ -51,9 +56,12 @@ struct PreparedCameraOptions {
         u_.Normalize();
     }
 
-    Ray EmitRay(int i, int j) const {
-        double y = (1.0 * i + 0.5) / options.screen_height;
-        double x = (1.0 * j + 0.5) / options.screen_width;
+    // Ray through the point (i + dy, j + dx) of the screen, measured in pixels from its top left
+    // corner. By default it goes through the centre of pixel (i, j).
+    Ray EmitRay(int i, int j, double dy = 0.5, double dx = 0.5) const {
+        ++GetThreadRayCounters().primary_rays;
+        double y = (1.0 * i + dy) / options.screen_height;
+        double x = (1.0 * j + dx) / options.screen_width;
         double cy = hszy_ - 2.0 * hszy_ * y;
         double cx = -hszx_ + 2.0 * hszx_ * x;
         return Ray(options.look_from, r_ * cx + u_ * cy + f_);
@@ -64,79 +72,400 @@ private:
     double hszy_, hszx_;
 };
 
+// How the BVHs of a scene are built for the render options.
+BVHOptions GetBVHOptions(const RenderOptions& options, size_t min_leaf_size = 1) {
+    return {.quality = options.bvh_quality,
+            .min_leaf_size = min_leaf_size,
+            .threads = options.threads};
+}
+
+// BVH and triangle packets of one mesh, the packets in float precision if float_geometry is set
+// (see RenderOptions::float_geometry). The other kind is left empty.
+struct PreparedMesh {
+    const Mesh& mesh;
+    bool float_geometry;
+    BVH bvh;
+    TrianglePackets triangles;
+    FloatTrianglePackets float_triangles;
+
+    PreparedMesh(const Mesh& m, const RenderOptions& options)
+        : mesh(m),
+          float_geometry(options.float_geometry),
+          bvh(GetBounds(m), GetBVHOptions(options, float_geometry ? kFloatPacketSize : 1)) {
+        if (float_geometry) {
+            float_triangles = FloatTrianglePackets(m, bvh);
+        } else {
+            triangles = TrianglePackets(m, bvh);
+        }
+    }
+
+private:
+    static std::vector<BoundingBox> GetBounds(const Mesh& mesh) {
+        std::vector<BoundingBox> bounds;
+        bounds.reserve(mesh.Size());
+        for (size_t i = 0; i < mesh.Size(); ++i) {
+            bounds.push_back(GetBoundingBox(mesh.GetTriangle(i)));
+        }
+        return bounds;
+    }
+};
+
+// Box around the image of the box under the transform.
+BoundingBox GetBoundingBox(const BoundingBox& box, const Transform& transform) {
+    BoundingBox res;
+    if (box.Empty()) {
+        return res;
+    }
+    for (int corner = 0; corner < 8; ++corner) {
+        Vector p{(corner & 1) ? box.max[0] : box.min[0], (corner & 2) ? box.max[1] : box.min[1],
+                 (corner & 4) ? box.max[2] : box.min[2]};
+        res.Extend(transform.ApplyToPoint(p));
+    }
+    res.Pad();
+    return res;
+}
+
+// Two-level acceleration structure: the scene's own mesh and every prototype get a bottom-level
+// BVH of their triangles, and a top-level BVH is built over the world bounds of the instances.
+// An instance costs a transform and a leaf of the top level, however big its mesh is. Spheres
+// have a BVH of their own with packets of spheres in its leaves.
+struct PreparedScene {
+    const Scene& scene;
+    PreparedMesh mesh;
+    std::vector<PreparedMesh> prototypes;  // one per scene.GetPrototypes()
+    BVH instances;
+    BVH sphere_bvh;
+    SpherePackets spheres;
+
+    // Only float_geometry, bvh_quality and threads of the options are used.
+    explicit PreparedScene(const Scene& s, const RenderOptions& options = {})
+        : scene(s),
+          mesh(s.GetMesh(), options),
+          sphere_bvh(GetBounds(s.GetSphereObjects()), GetBVHOptions(options)),
+          spheres(s.GetSphereObjects(), sphere_bvh) {
+        prototypes.reserve(s.GetPrototypes().size());
+        for (const auto& prototype : s.GetPrototypes()) {
+            prototypes.emplace_back(prototype.GetMesh(), options);
+        }
+        std::vector<BoundingBox> bounds;
+        bounds.reserve(s.GetInstances().size());
+        for (const auto& instance : s.GetInstances()) {
+            bounds.push_back(GetBoundingBox(prototypes[instance.prototype].bvh.GetBounds(),
+                                            instance.transform));
+        }
+        instances = BVH(bounds, GetBVHOptions(options));
+    }
+
+    // Box around all primitives of the scene.
+    BoundingBox GetBounds() const {
+        auto bounds = mesh.bvh.GetBounds();
+        for (const auto* bvh : {&instances, &sphere_bvh}) {
+            if (!bvh->GetBounds().Empty()) {
+                bounds.Extend(bvh->GetBounds());
+            }
+        }
+        return bounds;
+    }
+
+private:
+    static std::vector<BoundingBox> GetBounds(const std::vector<SphereObject>& spheres) {
+        std::vector<BoundingBox> bounds;
+        bounds.reserve(spheres.size());
+        for (const auto& s : spheres) {
+            bounds.push_back(GetBoundingBox(s.sphere));
+        }
+        return bounds;
+    }
+};
+
 struct ShotResult {
     double distance{-1};
     Vector point{-1, -2, -3};
     Vector n{-1, -2, -3};
     const Material* material;
     Ray original;
-    std::optional<SphereObject> sphere;
+    const SphereObject* sphere = nullptr;  // the sphere that was hit, nullptr for a triangle
 };
 
-std::optional<ShotResult> Shot(const Scene& scene, Ray ray) {
-    std::optional<ShotResult> res = std::nullopt;
+// Relative error of float packet distances that is certainly not exceeded.
+const double kFloatDistanceSlack = 1e-3;
 
-    for (auto t : scene.GetObjects()) {
-        auto inter = GetIntersection(ray, t.polygon);
-        if (!inter) {
-            continue;
-        }
-        double x = inter->GetDistance();
-        if (res && res->distance < x) {
-            continue;
+// Distance to the triangle in the lane of the packet given the distance x the packet test gave
+// for it, infinity if it is a miss or farther than max_distance. Float packets only pick
+// candidates, a hit is confirmed in double precision against the mesh so that distances are
+// exactly those of the double path.
+template <class T>
+double GetTriangleDistance(const PreparedMesh& prepared, const Ray& ray,
+                           const BasicTrianglePacket<T>& packet, uint32_t lane, T x,
+                           double max_distance) {
+    if constexpr (std::is_same_v<T, double>) {
+        return x;
+    } else {
+        if (x == std::numeric_limits<T>::infinity() ||
+            x > (max_distance + kEps) * (1 + kFloatDistanceSlack) + kFloatDistanceSlack) {
+            return kInf;
         }
+        auto triangle = prepared.mesh.GetTriangle(packet.index[lane]);
+        return GetIntersectionDistance(ray, triangle).value_or(kInf);
+    }
+}
 
-        Vector def = inter->GetNormal();
-        Vector bc = GetBarycentricCoords(t.polygon, inter->GetPosition());
-        Vector n0 = *t.GetNormal(0);
-        Vector n1 = *t.GetNormal(1);
-        Vector n2 = *t.GetNormal(2);
+// Closest triangle the ray hits closer than distance, which is set to its distance. Same
+// tie-breaking as a linear scan: among equally distant hits the last triangle wins.
+template <class T>
+std::optional<size_t> FindClosestTriangle(const PreparedMesh& prepared,
+                                          const BasicTrianglePackets<T>& triangles,
+                                          const Ray& ray, double& distance) {
+    auto& counters = GetThreadRayCounters();
+    std::optional<size_t> closest;
+    counters.bvh_node_visits +=
+        prepared.bvh.Traverse(ray, distance, [&](uint32_t leaf, double& max_distance) {
+            for (const auto& packet : triangles.GetLeaf(leaf)) {
+                counters.triangle_tests += packet.count;
+                auto xs = GetIntersectionDistances(ray, packet);
+                for (uint32_t lane = 0; lane < packet.count; ++lane) {
+                    double x =
+                        GetTriangleDistance(prepared, ray, packet, lane, xs[lane], max_distance);
+                    size_t index = packet.index[lane];
+                    if (x < max_distance || (x == max_distance && closest && *closest < index)) {
+                        closest = index;
+                        max_distance = x;
+                    }
+                }
+            }
+            return false;
+        });
+    return closest;
+}
 
-        Vector ns = n0 * bc[0] + n1 * bc[1] + n2 * bc[2];
-        if (Compare(Length(ns)) == 0) {
-            ns = def;
-        } else {
-            ns.Normalize();
-        }
+std::optional<size_t> FindClosestTriangle(const PreparedMesh& prepared, const Ray& ray,
+                                          double& distance) {
+    return prepared.float_geometry
+               ? FindClosestTriangle(prepared, prepared.float_triangles, ray, distance)
+               : FindClosestTriangle(prepared, prepared.triangles, ray, distance);
+}
 
-        if (DotProduct(ns, def) < 0.0) {
-            ns *= -1.0;
+// Whether a triangle blocks the ray closer than max_distance.
+template <class T>
+bool OccludedByTriangles(const PreparedMesh& prepared, const BasicTrianglePackets<T>& triangles,
+                         const Ray& ray, double max_distance) {
+    auto& counters = GetThreadRayCounters();
+    bool occluded = false;
+    double distance = max_distance;
+    counters.bvh_node_visits += prepared.bvh.Traverse(ray, distance, [&](uint32_t leaf, double&) {
+        for (const auto& packet : triangles.GetLeaf(leaf)) {
+            counters.triangle_tests += packet.count;
+            auto xs = GetIntersectionDistances(ray, packet);
+            for (uint32_t lane = 0; lane < packet.count; ++lane) {
+                double x =
+                    GetTriangleDistance(prepared, ray, packet, lane, xs[lane], max_distance);
+                if (Compare(x, max_distance) < 0) {
+                    occluded = true;
+                }
+            }
         }
-        res = ShotResult{
-            .distance = x,
-            .point = inter->GetPosition(),
-            .n = ns,
-            .material = t.material,
-            .original = ray,
-            .sphere = std::nullopt,
-        };
+        return occluded;
+    });
+    return occluded;
+}
+
+bool OccludedByTriangles(const PreparedMesh& prepared, const Ray& ray, double max_distance) {
+    return prepared.float_geometry
+               ? OccludedByTriangles(prepared, prepared.float_triangles, ray, max_distance)
+               : OccludedByTriangles(prepared, prepared.triangles, ray, max_distance);
+}
+
+// The ray in the space of the instance's prototype, and the length there of a unit of distance
+// along the ray, which converts distances between the two spaces.
+std::pair<Ray, double> ToPrototypeSpace(const MeshInstance& instance, const Ray& ray) {
+    Vector direction = instance.inverse.ApplyToDirection(ray.GetDirection());
+    double scale = Length(direction);
+    return {Ray{instance.inverse.ApplyToPoint(ray.GetOrigin()), direction * (1 / scale),
+                Ray::kUnitDirection},
+            scale};
+}
+
+struct InstanceHit {
+    uint32_t instance;
+    size_t triangle;
+};
+
+// Closest triangle of an instance the ray hits closer than distance, which is set to its
+// distance. Only instances whose box the ray enters closer than the best hit so far are
+// transformed and searched.
+std::optional<InstanceHit> FindClosestInstanceTriangle(const PreparedScene& prepared,
+                                                       const Ray& ray, double& distance) {
+    const auto& instances = prepared.scene.GetInstances();
+    auto& counters = GetThreadRayCounters();
+    std::optional<InstanceHit> closest;
+    counters.bvh_node_visits +=
+        prepared.instances.Traverse(ray, distance, [&](uint32_t leaf, double& max_distance) {
+            for (auto index : prepared.instances.GetLeaf(leaf)) {
+                const auto& instance = instances[index];
+                auto [local_ray, scale] = ToPrototypeSpace(instance, ray);
+                double local_distance = max_distance * scale;
+                auto triangle = FindClosestTriangle(prepared.prototypes[instance.prototype],
+                                                    local_ray, local_distance);
+                if (triangle) {
+                    closest = InstanceHit{index, *triangle};
+                    max_distance = local_distance / scale;
+                }
+            }
+            return false;
+        });
+    return closest;
+}
+
+// Whether a triangle of an instance blocks the ray closer than max_distance.
+bool OccludedByInstances(const PreparedScene& prepared, const Ray& ray, double max_distance) {
+    const auto& instances = prepared.scene.GetInstances();
+    auto& counters = GetThreadRayCounters();
+    bool occluded = false;
+    double distance = max_distance;
+    counters.bvh_node_visits +=
+        prepared.instances.Traverse(ray, distance, [&](uint32_t leaf, double&) {
+            for (auto index : prepared.instances.GetLeaf(leaf)) {
+                const auto& instance = instances[index];
+                auto [local_ray, scale] = ToPrototypeSpace(instance, ray);
+                if (OccludedByTriangles(prepared.prototypes[instance.prototype], local_ray,
+                                        max_distance * scale)) {
+                    occluded = true;
+                    break;
+                }
+            }
+            return occluded;
+        });
+    return occluded;
+}
+
+// Closest sphere the ray hits no farther than distance, which is set to its distance. Spheres
+// win ties against triangles, and among equally distant spheres the last one wins.
+std::optional<size_t> FindClosestSphere(const PreparedScene& prepared, const Ray& ray,
+                                        double& distance) {
+    auto& counters = GetThreadRayCounters();
+    std::optional<size_t> closest;
+    counters.bvh_node_visits +=
+        prepared.sphere_bvh.Traverse(ray, distance, [&](uint32_t leaf, double& max_distance) {
+            for (const auto& packet : prepared.spheres.GetLeaf(leaf)) {
+                counters.sphere_tests += packet.count;
+                auto xs = GetIntersectionDistances(ray, packet);
+                for (uint32_t lane = 0; lane < packet.count; ++lane) {
+                    double x = xs[lane];
+                    size_t index = packet.index[lane];
+                    if (x < max_distance || (x == max_distance && x != kInf &&
+                                             (!closest || *closest < index))) {
+                        closest = index;
+                        max_distance = x;
+                    }
+                }
+            }
+            return false;
+        });
+    return closest;
+}
+
+// Whether a sphere blocks the ray closer than max_distance.
+bool OccludedBySpheres(const PreparedScene& prepared, const Ray& ray, double max_distance) {
+    auto& counters = GetThreadRayCounters();
+    bool occluded = false;
+    double distance = max_distance;
+    counters.bvh_node_visits +=
+        prepared.sphere_bvh.Traverse(ray, distance, [&](uint32_t leaf, double&) {
+            for (const auto& packet : prepared.spheres.GetLeaf(leaf)) {
+                counters.sphere_tests += packet.count;
+                auto xs = GetIntersectionDistances(ray, packet);
+                for (uint32_t lane = 0; lane < packet.count; ++lane) {
+                    if (Compare(xs[lane], max_distance) < 0) {
+                        occluded = true;
+                    }
+                }
+            }
+            return occluded;
+        });
+    return occluded;
+}
+
+// Shading data of the hit of the ray with the index-th triangle of the mesh.
+ShotResult GetTriangleShot(const Mesh& mesh, size_t index, const Ray& ray) {
+    auto polygon = mesh.GetTriangle(index);
+    auto inter = GetIntersection(ray, polygon);
+    Vector def = inter->GetNormal();
+    Vector bc = GetBarycentricCoords(polygon, inter->GetPosition());
+    auto [n0, n1, n2] = mesh.GetNormals(index);
+
+    Vector ns = n0 * bc[0] + n1 * bc[1] + n2 * bc[2];
+    if (Compare(Length(ns)) == 0) {
+        ns = def;
+    } else {
+        ns.Normalize();
+    }
+
+    if (DotProduct(ns, def) < 0.0) {
+        ns *= -1.0;
     }
+    return ShotResult{
+        .distance = inter->GetDistance(),
+        .point = inter->GetPosition(),
+        .n = ns,
+        .material = mesh.GetMaterial(index),
+        .original = ray,
+    };
+}
+
+std::optional<ShotResult> Shot(const PreparedScene& prepared, Ray ray) {
+    const Scene& scene = prepared.scene;
+
+    // Find the closest primitive by distance alone, shading data is computed for it only.
+    double distance = kInf;
+    auto closest = FindClosestTriangle(prepared.mesh, ray, distance);
+    auto closest_instance = FindClosestInstanceTriangle(prepared, ray, distance);
+
+    auto closest_sphere = FindClosestSphere(prepared, ray, distance);
 
-    for (auto s : scene.GetSphereObjects()) {
+    if (closest_sphere) {
+        const auto& s = scene.GetSphereObjects()[*closest_sphere];
         auto inter = GetIntersection(ray, s.sphere);
-        if (!inter) {
-            continue;
-        }
-        double x = (*inter).GetDistance();
-        if (res && res->distance < x) {
-            continue;
-        }
-        res = ShotResult{
-            .distance = x,
+        return ShotResult{
+            .distance = inter->GetDistance(),
             .point = inter->GetPosition(),
             .n = inter->GetNormal(),
             .material = s.material,
             .original = ray,
-            .sphere = s,
+            .sphere = &s,
         };
     }
-    return res;
+    if (closest_instance) {
+        // Shade in the space of the prototype and bring the hit back. Normals map by the
+        // transposed inverse, which keeps the side of the surface the ray comes from.
+        const auto& instance = scene.GetInstances()[closest_instance->instance];
+        auto [local_ray, scale] = ToPrototypeSpace(instance, ray);
+        auto shr = GetTriangleShot(scene.GetPrototypes()[instance.prototype].GetMesh(),
+                                   closest_instance->triangle, local_ray);
+        shr.distance /= scale;
+        shr.point = instance.transform.ApplyToPoint(shr.point);
+        shr.n = instance.inverse.ApplyTransposed(shr.n);
+        shr.n.Normalize();
+        shr.original = ray;
+        return shr;
+    }
+    if (!closest) {
+        return std::nullopt;
+    }
+    return GetTriangleShot(scene.GetMesh(), *closest, ray);
+}
+
+// Whether anything blocks the ray closer than max_distance. Unlike Shot it stops at the first
+// blocker it finds and computes no shading data, which is all a shadow ray needs.
+bool Occluded(const PreparedScene& prepared, const Ray& ray, double max_distance) {
+    return OccludedBySpheres(prepared, ray, max_distance) ||
+           OccludedByTriangles(prepared.mesh, ray, max_distance) ||
+           OccludedByInstances(prepared, ray, max_distance);
 }
 
 const Vector kNoObject = Vector();
 
-Ray RefractRay(ShotResult shr, double eta) {
-    auto ray_direction_opt = Refract(shr.original.GetDirection(), shr.n, eta);
+Ray RefractRay(const ShotResult& shr, double eta) {
+    auto ray_direction_opt = RefractUnit(shr.original.GetDirection(), shr.n, eta);
     if (!ray_direction_opt) {
         assert(false && "can't refract");
     }
@@ -148,29 +477,67 @@ Ray RefractRay(ShotResult shr, double eta) {
     } else {
         ray_origin -= shr.n * kEps;
     }
-    Ray refract_ray = Ray{ray_origin, *ray_direction_opt};
+    Ray refract_ray = Ray{ray_origin, *ray_direction_opt, Ray::kUnitDirection};
     return refract_ray;
 }
 
-Vector TraceRay(const Scene& scene, Ray ray, int depth) {
-    auto oshr = Shot(scene, ray);
-    if (!oshr) {
-        return kNoObject;
+// Longest chain of reflections and refractions followed from a primary ray. Reflections are
+// limited by the render depth as well, refractions only by this.
+const int kMaxRayGeneration = 32;
+
+// Secondary ray waiting to be traced, its color adds to the pixel multiplied by weight.
+struct WeightedRay {
+    Ray ray;
+    double weight;
+    int depth;       // reflections left
+    int generation;  // reflections and refractions between the primary ray and this one
+    uint64_t path;   // see GetPathKey
+};
+
+// Rays are traced depth first and each one pushes at most two rays of the next generation, so
+// at most one ray per generation is ever waiting besides the two last pushed, and a stack of
+// kMaxRayGeneration + 1 rays can't overflow.
+class RayStack {
+public:
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    void Push(const WeightedRay& ray) {
+        assert(size_ < rays_.size() && "ray stack overflow");
+        rays_[size_++] = ray;
     }
-    auto shr = *oshr;
 
+    WeightedRay Pop() {
+        return *rays_[--size_];
+    }
+
+private:
+    // optional to leave the slots unconstructed until used.
+    std::array<std::optional<WeightedRay>, kMaxRayGeneration + 1> rays_;
+    size_t size_ = 0;
+};
+
+// Ray from the hit towards the light and the distance to the light along it.
+std::pair<Ray, double> GetShadowRay(const ShotResult& shr, const Light& light) {
+    Vector ray_origin = shr.point + shr.n * kEps;
+    Vector ray_direction = light.position - ray_origin;
+    return {Ray{ray_origin, ray_direction}, Distance(ray_origin, light.position)};
+}
+
+// Color of the hit lit by the lights, without what it reflects or refracts. is_lit(k) tells
+// whether the k-th light of the scene reaches the hit.
+template <class IsLit>
+Vector ShadeSurface(const PreparedScene& scene, const ShotResult& shr, IsLit&& is_lit) {
     auto p = shr.point;
     auto n = shr.n;
     auto m = shr.material;
 
-    // simple colors
     Vector diffuse{}, specular{};
-    for (auto light : scene.GetLights()) {
-        Vector ray_origin = p + n * kEps;
-        Vector ray_direction = light.position - ray_origin;
-        double light_distance = Distance(ray_origin, light.position);
-        auto shr2 = Shot(scene, Ray{ray_origin, ray_direction});
-        if (shr2 && Compare(shr2->distance, light_distance) < 0) {
+    const auto& lights = scene.scene.GetLights();
+    for (size_t k = 0; k < lights.size(); ++k) {
+        const auto& light = lights[k];
+        if (!is_lit(k)) {
             continue;
         }
 
@@ -182,14 +549,12 @@ Vector TraceRay(const Scene& scene, Ray ray, int depth) {
         }
 
         {
+            // Both the normal and the ray direction are unit already.
             Vector from_light = Vector{light.position, p};
             from_light.Normalize();
-            Vector vlr = Reflect(from_light, n);
-            vlr.Normalize();
+            Vector vlr = ReflectUnit(from_light, n);
             vlr *= -1.0;
-            Vector vr = shr.original.GetDirection();
-            vr.Normalize();
-            double dot = std::max(0.0, DotProduct(vr, vlr));
+            double dot = std::max(0.0, DotProduct(shr.original.GetDirection(), vlr));
             dot = pow(dot, m->specular_exponent);
             specular += light.intensity * dot;
         }
@@ -199,111 +564,893 @@ Vector TraceRay(const Scene& scene, Ray ray, int depth) {
     res *= m->albedo[0];
     res += m->ambient_color;
     res += m->intensity;
+    return res;
+}
 
-    // reflections
-    if (depth > 0 && Compare(m->albedo[1]) > 0) {
-        Vector reflected_direction = Reflect(shr.original.GetDirection(), n);
-        Vector reflect_origin = p + n * kEps;
-        Ray reflect_ray = Ray{reflect_origin, reflected_direction};
-        auto reflected = TraceRay(scene, reflect_ray, depth - 1);
-        res += reflected * m->albedo[1];
+// Same with a shadow ray traced for every light.
+Vector ShadeSurface(const PreparedScene& scene, const ShotResult& shr) {
+    const auto& lights = scene.scene.GetLights();
+    return ShadeSurface(scene, shr, [&](size_t k) {
+        auto [ray, distance] = GetShadowRay(shr, lights[k]);
+        ++GetThreadRayCounters().shadow_rays;
+        return !Occluded(scene, ray, distance);
+    });
+}
+
+enum class SecondaryRay { kRefracted, kReflected };
+
+// Mixes the bits of x, the finalizer of splitmix64.
+uint64_t MixBits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// Key of the path of a ray for the draws of russian roulette. A primary ray's key comes from
+// its direction, which differs between pixels and their anti-aliasing samples, and a secondary
+// ray's from its parent's key and its kind, so the draws don't depend on the order rays are
+// traced in: depth first, as a wavefront or on any number of threads.
+uint64_t GetPathKey(const Ray& ray) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        key = MixBits(key ^ std::bit_cast<uint64_t>(ray.GetDirection()[i]));
+    }
+    return key;
+}
+
+uint64_t GetPathKey(uint64_t parent, SecondaryRay kind) {
+    return MixBits(parent + (kind == SecondaryRay::kRefracted ? 1 : 2));
+}
+
+// Whether a ray of the path is traced, see RayTermination. Raises the weight of a ray that
+// survives russian roulette.
+bool SurvivesTermination(const RayTermination& termination, uint64_t path, double& weight) {
+    if (weight >= termination.min_weight) {
+        return true;
+    }
+    if (!termination.russian_roulette) {
+        return false;
+    }
+    // Uniform in [0, 1) from the top 53 bits of the mixed key.
+    double draw = static_cast<double>(MixBits(path) >> 11) * 0x1p-53;
+    if (draw * termination.min_weight >= weight) {
+        return false;
     }
+    weight = termination.min_weight;
+    return true;
+}
+
+// Passes the rays the hit refracts and reflects, in this order, to
+// emit(kind, ray, weight, depth, path) along with the weight of their color, the reflections
+// left after them and their path key. The hit's ray has the given weight and path key, rays
+// that termination drops aren't traced or emitted.
+template <class Emit>
+void EmitSecondaryRays(const PreparedScene& scene, const ShotResult& shr, int depth,
+                       double weight, uint64_t path, const RayTermination& termination,
+                       Emit&& emit) {
+    auto& counters = GetThreadRayCounters();
+    auto m = shr.material;
 
     // refraction
-    if (Compare(m->albedo[2]) > 0) {
+    auto refract_path = GetPathKey(path, SecondaryRay::kRefracted);
+    auto refract_weight = weight * m->albedo[2];
+    if (Compare(m->albedo[2]) > 0 &&
+        SurvivesTermination(termination, refract_path, refract_weight)) {
         auto refract_ray = RefractRay(shr, 1 / m->refraction_index);
+        ++counters.refraction_rays;
         if (shr.sphere) {
+            // The ray crosses the sphere and leaves it as a second refracted ray.
+            ++counters.refraction_rays;
             auto shr_internal = Shot(scene, refract_ray);
             if (!shr_internal) {
                 assert(false && "should shot in the same sphere");
             }
             refract_ray = RefractRay(*shr_internal, m->refraction_index);
         }
-        auto refracted = TraceRay(scene, refract_ray, depth);
-        res += refracted * m->albedo[2];
+        emit(SecondaryRay::kRefracted, refract_ray, refract_weight, depth, refract_path);
+    }
+
+    // reflections
+    auto reflect_path = GetPathKey(path, SecondaryRay::kReflected);
+    auto reflect_weight = weight * m->albedo[1];
+    if (depth > 0 && Compare(m->albedo[1]) > 0 &&
+        SurvivesTermination(termination, reflect_path, reflect_weight)) {
+        Vector reflected_direction = ReflectUnit(shr.original.GetDirection(), shr.n);
+        Vector reflect_origin = shr.point + shr.n * kEps;
+        ++counters.reflection_rays;
+        emit(SecondaryRay::kReflected,
+             Ray{reflect_origin, reflected_direction, Ray::kUnitDirection}, reflect_weight,
+             depth - 1, reflect_path);
     }
+}
 
+// Color seen along the ray that produced the hit. Reflected and refracted rays are traced
+// iteratively from a RayStack, each adding its surface color weighted by the albedos along its
+// path, so the stack use is bounded however much glass the scene has. Rays are followed as
+// termination allows.
+Vector Shade(const PreparedScene& scene, const ShotResult& hit, int depth,
+             const RayTermination& termination = {}) {
+    Vector res;
+    RayStack stack;
+    auto shade = [&](const ShotResult& shr, double weight, int depth, int generation,
+                     uint64_t path) {
+        res += ShadeSurface(scene, shr) * weight;
+        if (generation == kMaxRayGeneration) {
+            return;
+        }
+        EmitSecondaryRays(scene, shr, depth, weight, path, termination,
+                          [&](SecondaryRay, const Ray& ray, double ray_weight, int ray_depth,
+                              uint64_t ray_path) {
+                              stack.Push({ray, ray_weight, ray_depth, generation + 1, ray_path});
+                          });
+    };
+
+    shade(hit, 1, depth, 0, GetPathKey(hit.original));
+    while (!stack.Empty()) {
+        auto [ray, weight, ray_depth, generation, path] = stack.Pop();
+        if (auto shr = Shot(scene, ray)) {
+            shade(*shr, weight, ray_depth, generation, path);
+        }
+    }
     return res;
 }
 
-Image RenderFull(const Scene& scene, const PreparedCameraOptions& camera_options, int depth) {
-    FloatingImage res(camera_options.options.screen_width, camera_options.options.screen_height);
-    for (int i = 0; i < camera_options.options.screen_height; ++i) {
-        for (int j = 0; j < camera_options.options.screen_width; ++j) {
-            auto ray = camera_options.EmitRay(i, j);
-            auto color = TraceRay(scene, ray, depth);
-            res.SetPixel(i, j, FloatingRGB{color[0], color[1], color[2]});
+Vector TraceRay(const PreparedScene& scene, Ray ray, int depth,
+                const RayTermination& termination = {}) {
+    auto shr = Shot(scene, ray);
+    if (!shr) {
+        return kNoObject;
+    }
+    return Shade(scene, *shr, depth, termination);
+}
+
+const int kTileSize = 32;
+
+struct Tile {
+    int row_begin, row_end;
+    int col_begin, col_end;
+};
+
+std::vector<Tile> SplitIntoTiles(int width, int height) {
+    std::vector<Tile> tiles;
+    for (int i = 0; i < height; i += kTileSize) {
+        for (int j = 0; j < width; j += kTileSize) {
+            tiles.push_back(Tile{i, std::min(i + kTileSize, height), j,
+                                 std::min(j + kTileSize, width)});
         }
     }
-    res.ToneMapping();
-    res.GammaCorrection();
+    return tiles;
+}
 
-    return res.ToImage();
+// Copies the pixels of the tile, stored row by row in buffer, into the image.
+void CopyTile(FloatingImage& image, const Tile& tile, const std::vector<FloatingRGB>& buffer) {
+    int width = tile.col_end - tile.col_begin;
+    for (int i = tile.row_begin; i < tile.row_end; ++i) {
+        for (int j = tile.col_begin; j < tile.col_end; ++j) {
+            image.SetPixel(i, j, buffer[(i - tile.row_begin) * width + j - tile.col_begin]);
+        }
+    }
 }
-Image RenderDepth(const Scene& scene, const PreparedCameraOptions& camera_options) {
-    FloatingImage res(camera_options.options.screen_width, camera_options.options.screen_height);
+
+// Fills the tile with pixel(i, j). The tile is traced into its own buffer and copied out when
+// done, so workers don't write into neighbouring cache lines while tracing.
+template <class PixelFunc>
+void RenderTile(FloatingImage& image, const Tile& tile, PixelFunc&& pixel) {
+    std::vector<FloatingRGB> buffer;
+    buffer.reserve(kTileSize * kTileSize);
+    for (int i = tile.row_begin; i < tile.row_end; ++i) {
+        for (int j = tile.col_begin; j < tile.col_end; ++j) {
+            buffer.push_back(pixel(i, j));
+        }
+    }
+    CopyTile(image, tile, buffer);
+}
+
+// Fills every pixel of the image with pixel(i, j), tile by tile on the requested number of
+// threads.
+template <class PixelFunc>
+void RenderTiles(FloatingImage& image, int threads, PixelFunc&& pixel) {
+    auto tiles = SplitIntoTiles(image.Width(), image.Height());
+    ParallelTrace(tiles.size(), threads,
+                  [&](size_t index) { RenderTile(image, tiles[index], pixel); });
+}
+
+// Pixel values of the render modes for the primary hit of a pixel, nullopt for a miss. A hit
+// found once can feed all of them.
+FloatingRGB GetFullColor(const PreparedScene& scene, const std::optional<ShotResult>& hit,
+                         int depth, const RayTermination& termination = {}) {
+    auto color = hit ? Shade(scene, *hit, depth, termination) : kNoObject;
+    return FloatingRGB{color[0], color[1], color[2]};
+}
+
+FloatingRGB GetNormalColor(const std::optional<ShotResult>& hit) {
+    if (!hit) {
+        return FloatingRGB{0, 0, 0};
+    }
+    Vector n = hit->n;
+    return FloatingRGB{n[0] / 2.0 + 0.5, n[1] / 2.0 + 0.5, n[2] / 2.0 + 0.5};
+}
+
+// Diffuse color (Kd) of the material that was hit.
+FloatingRGB GetAlbedoColor(const std::optional<ShotResult>& hit) {
+    if (!hit) {
+        return FloatingRGB{0, 0, 0};
+    }
+    const Vector& color = hit->material->diffuse_color;
+    return FloatingRGB{color[0], color[1], color[2]};
+}
+
+// Distance to the hit in all three channels, infinity for a miss. NormalizeDepth turns a buffer
+// of these into a depth map once the largest distance is known.
+FloatingRGB GetDistance(const std::optional<ShotResult>& hit) {
+    double d = hit ? hit->distance : kInf;
+    return FloatingRGB{d, d, d};
+}
+
+FloatingRGB GetPixelValue(const PreparedScene& scene, const std::optional<ShotResult>& hit,
+                          RenderMode mode, int depth, const RayTermination& termination = {}) {
+    switch (mode) {
+        case RenderMode::kDepth:
+            return GetDistance(hit);
+        case RenderMode::kNormal:
+            return GetNormalColor(hit);
+        case RenderMode::kFull:
+            return GetFullColor(scene, hit, depth, termination);
+        case RenderMode::kAlbedo:
+            return GetAlbedoColor(hit);
+    }
+    return FloatingRGB{0, 0, 0};
+}
+
+FloatingRGB TraceFull(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                      const RenderOptions& render_options, int i, int j) {
+    return GetFullColor(scene, Shot(scene, camera_options.EmitRay(i, j)), render_options.depth,
+                        render_options.termination);
+}
+
+FloatingRGB TraceNormal(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                        int i, int j) {
+    return GetNormalColor(Shot(scene, camera_options.EmitRay(i, j)));
+}
+
+FloatingRGB TraceDistance(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                          int i, int j) {
+    return GetDistance(Shot(scene, camera_options.EmitRay(i, j)));
+}
+
+// Largest finite distance of an image of GetDistance values.
+double GetMaxDistance(const FloatingImage& image) {
     double dmax = 0;
-    for (int i = 0; i < camera_options.options.screen_height; ++i) {
-        // bench("finish row");
-        for (int j = 0; j < camera_options.options.screen_width; ++j) {
-            auto ray = camera_options.EmitRay(i, j);
-            // bench("ray emmited");
-            auto shr = Shot(scene, ray);
-            if (shr) {
-                dmax = std::max(dmax, shr->distance);
+    for (int i = 0; i < image.Height(); ++i) {
+        for (int j = 0; j < image.Width(); ++j) {
+            double d = image.GetPixel(i, j).r;
+            if (d != kInf) {
+                dmax = std::max(dmax, d);
             }
-            // bench("distance");
         }
     }
+    return dmax;
+}
+
+// Turns an image of GetDistance values into a depth map: distances are divided by dmax and
+// misses become white.
+void NormalizeDepth(FloatingImage& image, double dmax) {
     assert(Compare(dmax) > 0);
-    for (int i = 0; i < camera_options.options.screen_height; ++i) {
-        for (int j = 0; j < camera_options.options.screen_width; ++j) {
-            auto shr = Shot(scene, camera_options.EmitRay(i, j));
-            double d = dmax;
-            if (shr) {
-                d = shr->distance;
+    for (int i = 0; i < image.Height(); ++i) {
+        for (int j = 0; j < image.Width(); ++j) {
+            double d = std::min(image.GetPixel(i, j).r, dmax) / dmax;
+            image.SetPixel(i, j, FloatingRGB{d, d, d});
+        }
+    }
+}
+
+// NormalizeDepth by the largest distance of the image.
+void NormalizeDepth(FloatingImage& image) {
+    NormalizeDepth(image, GetMaxDistance(image));
+}
+
+// Turns the traced buffer of a mode into the final image.
+Image FinishImage(FloatingImage& image, RenderMode mode, int threads) {
+    if (mode == RenderMode::kDepth) {
+        NormalizeDepth(image);
+    } else if (mode == RenderMode::kFull) {
+        return image.ToDisplayImage(threads);
+    }
+    return image.ToImage(threads);
+}
+
+// FinishImage(image, mode, threads).Write(path) without building the final image.
+void WriteFinishedImage(FloatingImage& image, RenderMode mode, int threads,
+                        const std::filesystem::path& path) {
+    if (mode == RenderMode::kDepth) {
+        NormalizeDepth(image);
+    } else if (mode == RenderMode::kFull) {
+        image.WriteDisplayImage(path, threads);
+        return;
+    }
+    image.WriteImage(path, threads);
+}
+
+// Adaptive anti-aliasing of a traced full image, see RenderOptions::aa_samples. Returns the
+// number of pixels traced again.
+size_t RefineEdges(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                   const RenderOptions& render_options, FloatingImage& image) {
+    if (render_options.aa_samples <= 1) {
+        return 0;
+    }
+    int width = image.Width();
+    int height = image.Height();
+    auto compress = [&image](int i, int j) {
+        auto p = image.GetPixel(i, j);
+        return std::array{p.r / (1 + p.r), p.g / (1 + p.g), p.b / (1 + p.b)};
+    };
+    std::vector<double> contrast(width * height);
+    ParallelFor(height, render_options.threads, [&](size_t row) {
+        int i = row;
+        for (int j = 0; j < width; ++j) {
+            auto c = compress(i, j);
+            double max_difference = 0;
+            for (auto [ni, nj] : {std::pair{i - 1, j}, {i + 1, j}, {i, j - 1}, {i, j + 1}}) {
+                if (ni < 0 || ni >= height || nj < 0 || nj >= width) {
+                    continue;
+                }
+                auto n = compress(ni, nj);
+                for (size_t k = 0; k < 3; ++k) {
+                    max_difference = std::max(max_difference, std::abs(c[k] - n[k]));
+                }
+            }
+            contrast[i * width + j] = max_difference;
+        }
+    });
+
+    std::vector<uint32_t> pixels;
+    for (size_t index = 0; index < contrast.size(); ++index) {
+        if (contrast[index] > render_options.aa_threshold) {
+            pixels.push_back(index);
+        }
+    }
+    auto budget = static_cast<size_t>(std::max(0.0, render_options.aa_budget) * width * height);
+    if (pixels.size() > budget) {
+        std::ranges::nth_element(pixels, pixels.begin() + budget, [&](uint32_t a, uint32_t b) {
+            return contrast[a] > contrast[b] || (contrast[a] == contrast[b] && a < b);
+        });
+        pixels.resize(budget);
+    }
+
+    auto grid = static_cast<int>(std::ceil(std::sqrt(render_options.aa_samples)));
+    ParallelTrace(pixels.size(), render_options.threads, [&](size_t k) {
+        int i = pixels[k] / width;
+        int j = pixels[k] % width;
+        Vector sum;
+        for (int a = 0; a < grid; ++a) {
+            for (int b = 0; b < grid; ++b) {
+                auto ray = camera_options.EmitRay(i, j, (a + 0.5) / grid, (b + 0.5) / grid);
+                sum += TraceRay(scene, ray, render_options.depth, render_options.termination);
             }
-            d /= dmax;
-            res.SetPixel(i, j, FloatingRGB{d, d, d});
         }
+        sum *= 1.0 / (grid * grid);
+        image.SetPixel(i, j, FloatingRGB{sum[0], sum[1], sum[2]});
+    });
+    return pixels.size();
+}
+
+// Ray of a wavefront render, its color adds to pixel pixel of the wave multiplied by weight.
+struct WavefrontRay {
+    Ray ray;
+    uint32_t pixel;
+    double weight;
+    int depth;       // reflections left
+    int generation;  // reflections and refractions between the primary ray and this one
+    uint64_t path;   // see GetPathKey
+};
+
+// A wavefront render traces waves of rows with about this many pixels each, small enough for
+// the queues of a wave to stay in cache.
+const size_t kWavefrontSize = 1 << 12;
+
+// Octants of the direction of the ray and of its origin around center, as a number in [0, 64).
+// Rays with the same key go the same way from the same part of the scene and tend to visit the
+// same BVH nodes.
+size_t GetOctantKey(const Ray& ray, const Vector& center) {
+    size_t key = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        key |= static_cast<size_t>(ray.GetSign(i)) << i;
+        key |= static_cast<size_t>(ray.GetOrigin()[i] < center[i]) << (i + 3);
+    }
+    return key;
+}
+
+// Stable counting sort of the elements by the octant key of get_ray(element).
+template <class T, class GetRay>
+void SortByOctant(std::vector<T>& elements, const Vector& center, GetRay&& get_ray) {
+    std::vector<uint8_t> keys;
+    keys.reserve(elements.size());
+    std::array<size_t, 65> offsets{};
+    for (const auto& element : elements) {
+        keys.push_back(GetOctantKey(get_ray(element), center));
+        ++offsets[keys.back() + 1];
+    }
+    for (size_t key = 1; key < offsets.size(); ++key) {
+        offsets[key] += offsets[key - 1];
+    }
+    std::vector<uint32_t> order(elements.size());
+    for (size_t index = 0; index < elements.size(); ++index) {
+        order[offsets[keys[index]]++] = index;
+    }
+    std::vector<T> sorted;
+    sorted.reserve(elements.size());
+    for (auto index : order) {
+        sorted.push_back(std::move(elements[index]));
+    }
+    elements = std::move(sorted);
+}
+
+// Traces one queue of a wavefront render: sorts its rays, finds all of their hits, traces the
+// shadow rays of all hits as another sorted batch, then shades the hits into colors and queues
+// the rays they refract and reflect.
+void TraceWavefrontQueue(const PreparedScene& scene, const Vector& center,
+                         std::vector<WavefrontRay>& queue, std::vector<Vector>& colors,
+                         std::vector<WavefrontRay>* refracted,
+                         std::vector<WavefrontRay>* reflected,
+                         const RayTermination& termination) {
+    SortByOctant(queue, center, [](const WavefrontRay& ray) -> const Ray& { return ray.ray; });
+    std::vector<std::optional<ShotResult>> hits;
+    hits.reserve(queue.size());
+    for (const auto& ray : queue) {
+        hits.push_back(Shot(scene, ray.ray));
+    }
+
+    // Whether the l-th light reaches the k-th hit is lit[k * lights.size() + l].
+    struct ShadowRay {
+        Ray ray;
+        double distance;
+        uint32_t index;
+    };
+    const auto& lights = scene.scene.GetLights();
+    std::vector<ShadowRay> shadow_rays;
+    for (size_t k = 0; k < hits.size(); ++k) {
+        for (size_t l = 0; hits[k] && l < lights.size(); ++l) {
+            auto [ray, distance] = GetShadowRay(*hits[k], lights[l]);
+            shadow_rays.push_back({ray, distance, static_cast<uint32_t>(k * lights.size() + l)});
+        }
+    }
+    SortByOctant(shadow_rays, center, [](const ShadowRay& ray) -> const Ray& { return ray.ray; });
+    std::vector<char> lit(hits.size() * lights.size());
+    auto& counters = GetThreadRayCounters();
+    for (const auto& shadow_ray : shadow_rays) {
+        ++counters.shadow_rays;
+        lit[shadow_ray.index] = !Occluded(scene, shadow_ray.ray, shadow_ray.distance);
     }
 
-    return res.ToImage();
+    for (size_t k = 0; k < hits.size(); ++k) {
+        if (!hits[k]) {
+            continue;
+        }
+        const auto& ray = queue[k];
+        auto is_lit = [&](size_t l) { return lit[k * lights.size() + l]; };
+        colors[ray.pixel] += ShadeSurface(scene, *hits[k], is_lit) * ray.weight;
+        if (ray.generation == kMaxRayGeneration) {
+            continue;
+        }
+        EmitSecondaryRays(scene, *hits[k], ray.depth, ray.weight, ray.path, termination,
+                          [&](SecondaryRay kind, const Ray& next, double weight, int depth,
+                              uint64_t path) {
+                              auto* next_queue = kind == SecondaryRay::kRefracted ? refracted
+                                                                                  : reflected;
+                              next_queue->push_back(
+                                  {next, ray.pixel, weight, depth, ray.generation + 1, path});
+                          });
+    }
+}
+
+// Traces the full render into the image breadth first instead of pixel by pixel. The image is
+// split into waves of rows, which run in parallel. Within a wave, all primary rays are traced
+// as one queue, the rays they refract and reflect form the next two queues, and so on until no
+// rays are left. A generation has at most two queues, however many the one before it had. Every
+// queue and its shadow rays are sorted by octant (see GetOctantKey) and traced as a batch, so
+// consecutive rays tend to go through the same BVH nodes and triangles.
+// Gives the colors the depth-first tracer does, up to rounding.
+void TraceWavefront(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                    const RenderOptions& render_options, FloatingImage& image) {
+    auto bounds = scene.GetBounds();
+    Vector center = bounds.Empty() ? Vector{} : bounds.Center();
+    int width = image.Width();
+    int height = image.Height();
+    int wave_rows = std::max<int>(1, kWavefrontSize / std::max(1, width));
+    ParallelTrace((height + wave_rows - 1) / wave_rows, render_options.threads, [&](size_t wave) {
+        int row_begin = wave * wave_rows;
+        int rows = std::min(wave_rows, height - row_begin);
+        std::vector<std::vector<WavefrontRay>> queues(1);
+        queues[0].reserve(rows * width);
+        for (int i = row_begin; i < row_begin + rows; ++i) {
+            for (int j = 0; j < width; ++j) {
+                uint32_t pixel = (i - row_begin) * width + j;
+                auto ray = camera_options.EmitRay(i, j);
+                queues[0].push_back({ray, pixel, 1, render_options.depth, 0, GetPathKey(ray)});
+            }
+        }
+
+        std::vector<Vector> colors(rows * width);
+        while (!queues.empty()) {
+            // The rays all queues of a generation refract go into one queue of the next, and so
+            // do the rays they reflect.
+            std::vector<WavefrontRay> refracted, reflected;
+            for (auto& queue : queues) {
+                TraceWavefrontQueue(scene, center, queue, colors, &refracted, &reflected,
+                                    render_options.termination);
+            }
+            queues.clear();
+            for (auto* next : {&refracted, &reflected}) {
+                if (!next->empty()) {
+                    queues.push_back(std::move(*next));
+                }
+            }
+        }
+        for (int i = row_begin; i < row_begin + rows; ++i) {
+            for (int j = 0; j < width; ++j) {
+                const auto& color = colors[(i - row_begin) * width + j];
+                image.SetPixel(i, j, FloatingRGB{color[0], color[1], color[2]});
+            }
+        }
+    });
 }
 
-Image RenderNormal(const Scene& scene, const PreparedCameraOptions& camera_options) {
+// Traces the full render into a linear image, before tone mapping.
+FloatingImage TraceFullImage(const PreparedScene& scene,
+                             const PreparedCameraOptions& camera_options,
+                             const RenderOptions& render_options) {
     FloatingImage res(camera_options.options.screen_width, camera_options.options.screen_height);
-    for (int i = 0; i < camera_options.options.screen_height; ++i) {
-        for (int j = 0; j < camera_options.options.screen_width; ++j) {
-            auto shr = Shot(scene, camera_options.EmitRay(i, j));
-            if (shr) {
-                Vector n = shr->n;
-                res.SetPixel(i, j,
-                             FloatingRGB{n[0] / 2.0 + 0.5, n[1] / 2.0 + 0.5, n[2] / 2.0 + 0.5});
-            } else {
-                res.SetPixel(i, j, FloatingRGB{0, 0, 0});
+    if (render_options.wavefront) {
+        TraceWavefront(scene, camera_options, render_options, res);
+    } else {
+        RenderTiles(res, render_options.threads, [&](int i, int j) {
+            return TraceFull(scene, camera_options, render_options, i, j);
+        });
+    }
+    RefineEdges(scene, camera_options, render_options, res);
+    return res;
+}
+
+// The buffer of render_options.mode before FinishImage.
+FloatingImage TraceImage(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                         const RenderOptions& render_options) {
+    if (render_options.mode == RenderMode::kFull) {
+        return TraceFullImage(scene, camera_options, render_options);
+    }
+    FloatingImage res(camera_options.options.screen_width, camera_options.options.screen_height);
+    RenderTiles(res, render_options.threads, [&](int i, int j) {
+        return GetPixelValue(scene, Shot(scene, camera_options.EmitRay(i, j)), render_options.mode,
+                             render_options.depth, render_options.termination);
+    });
+    return res;
+}
+
+Image RenderFull(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                 const RenderOptions& render_options) {
+    return TraceFullImage(scene, camera_options, render_options)
+        .ToDisplayImage(render_options.threads);
+}
+
+// Traces every pixel once into a distance buffer and normalizes it afterwards.
+Image RenderDepth(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                  const RenderOptions& render_options) {
+    FloatingImage res(camera_options.options.screen_width, camera_options.options.screen_height);
+    RenderTiles(res, render_options.threads,
+                [&](int i, int j) { return TraceDistance(scene, camera_options, i, j); });
+    NormalizeDepth(res);
+    return res.ToImage(render_options.threads);
+}
+
+Image RenderNormal(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                   const RenderOptions& render_options) {
+    FloatingImage res(camera_options.options.screen_width, camera_options.options.screen_height);
+    RenderTiles(res, render_options.threads,
+                [&](int i, int j) { return TraceNormal(scene, camera_options, i, j); });
+    return res.ToImage(render_options.threads);
+}
+
+const int kProgressiveStep = 8;
+
+// Called after every pass of a progressive render with the linear (not tone mapped) image and the
+// pixel step of the pass, 1 for the last one.
+using ProgressCallback = std::function<void(const FloatingImage& image, int step)>;
+
+// Renders the frame in passes of decreasing pixel step. The first pass traces every 8th pixel in
+// both directions, each next pass halves the step and traces only the pixels that are new at that
+// step. Untraced pixels are filled from the traced pixel of their block, so every pass produces a
+// complete preview. The last pass traces all remaining pixels, the result matches RenderFull.
+Image RenderProgressive(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                        const RenderOptions& render_options, const ProgressCallback& on_pass) {
+    FloatingImage res(camera_options.options.screen_width, camera_options.options.screen_height);
+    std::vector<char> traced(res.Width() * res.Height());
+    for (int step = kProgressiveStep; step >= 1; step /= 2) {
+        ParallelTrace((res.Height() + step - 1) / step, render_options.threads, [&](size_t row) {
+            int i = row * step;
+            for (int j = 0; j < res.Width(); j += step) {
+                if (traced[i * res.Width() + j]) {
+                    continue;
+                }
+                auto color = TraceRay(scene, camera_options.EmitRay(i, j), render_options.depth,
+                                      render_options.termination);
+                res.SetPixel(i, j, FloatingRGB{color[0], color[1], color[2]});
+                traced[i * res.Width() + j] = true;
             }
+        });
+        if (step > 1) {
+            for (int i = 0; i < res.Height(); ++i) {
+                for (int j = 0; j < res.Width(); ++j) {
+                    if (!traced[i * res.Width() + j]) {
+                        res.SetPixel(i, j, res.GetPixel(i - i % step, j - j % step));
+                    }
+                }
+            }
+        }
+        if (step == 1) {
+            RefineEdges(scene, camera_options, render_options, res);
+        }
+        if (on_pass) {
+            on_pass(res, step);
         }
     }
-    return res.ToImage();
+    return res.ToDisplayImage(render_options.threads);
+}
+
+Scene LoadScene(const std::filesystem::path& path, const RenderOptions& render_options) {
+    return render_options.scene_cache ? ReadSceneCached(path) : ReadScene(path);
+}
+
+Image RenderProgressive(const std::filesystem::path& path, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, const ProgressCallback& on_pass) {
+    PreparedCameraOptions prep{camera_options};
+    auto scene = LoadScene(path, render_options);
+    PreparedScene prepared_scene{scene, render_options};
+    return RenderProgressive(prepared_scene, prep, render_options, on_pass);
+}
+
+// Renders all modes of render_options.outputs (or just render_options.mode if there are none)
+// in one traversal: every pixel is shot once and its primary hit is turned into the value of
+// each mode, so asking for depth and normals alongside the full render costs next to nothing.
+std::map<RenderMode, Image> RenderOutputs(const PreparedScene& scene,
+                                          const PreparedCameraOptions& camera_options,
+                                          const RenderOptions& render_options) {
+    auto modes = render_options.outputs;
+    if (modes.empty()) {
+        modes.push_back(render_options.mode);
+    }
+    std::ranges::sort(modes);
+    modes.erase(std::ranges::unique(modes).begin(), modes.end());
+
+    int width = camera_options.options.screen_width;
+    int height = camera_options.options.screen_height;
+    std::vector<FloatingImage> images(modes.size(), FloatingImage(width, height));
+    auto tiles = SplitIntoTiles(width, height);
+    ParallelTrace(tiles.size(), render_options.threads, [&](size_t index) {
+        const Tile& tile = tiles[index];
+        std::vector<std::vector<FloatingRGB>> buffers(modes.size());
+        for (int i = tile.row_begin; i < tile.row_end; ++i) {
+            for (int j = tile.col_begin; j < tile.col_end; ++j) {
+                auto hit = Shot(scene, camera_options.EmitRay(i, j));
+                for (size_t k = 0; k < modes.size(); ++k) {
+                    buffers[k].push_back(
+                        GetPixelValue(scene, hit, modes[k], render_options.depth,
+                                      render_options.termination));
+                }
+            }
+        }
+        for (size_t k = 0; k < modes.size(); ++k) {
+            CopyTile(images[k], tile, buffers[k]);
+        }
+    });
+
+    std::map<RenderMode, Image> res;
+    for (size_t k = 0; k < modes.size(); ++k) {
+        if (modes[k] == RenderMode::kFull) {
+            RefineEdges(scene, camera_options, render_options, images[k]);
+        }
+        res.emplace(modes[k], FinishImage(images[k], modes[k], render_options.threads));
+    }
+    return res;
+}
+
+std::map<RenderMode, Image> RenderOutputs(const std::filesystem::path& path,
+                                          const CameraOptions& camera_options,
+                                          const RenderOptions& render_options) {
+    PreparedCameraOptions prep{camera_options};
+    auto scene = LoadScene(path, render_options);
+    PreparedScene prepared_scene{scene, render_options};
+    return RenderOutputs(prepared_scene, prep, render_options);
 }
 
 Image Render(const std::filesystem::path& path, const CameraOptions& camera_options,
              const RenderOptions& render_options) {
-    // start = std::chrono::steady_clock::now();
-    // last = std::chrono::steady_clock::now();
     PreparedCameraOptions prep{camera_options};
-    auto scene = ReadScene(path);
-    // bench("Read Scene");
+    auto scene = LoadScene(path, render_options);
+    PreparedScene prepared_scene{scene, render_options};
     if (render_options.mode == RenderMode::kDepth) {
-        return RenderDepth(scene, prep);
+        return RenderDepth(prepared_scene, prep, render_options);
     }
     if (render_options.mode == RenderMode::kNormal) {
-        return RenderNormal(scene, prep);
+        return RenderNormal(prepared_scene, prep, render_options);
     }
     if (render_options.mode == RenderMode::kFull) {
-        return RenderFull(scene, prep, render_options.depth);
+        return RenderFull(prepared_scene, prep, render_options);
     }
 
-    return Image{camera_options.screen_width, camera_options.screen_height};
+    RenderOptions single = render_options;
+    single.outputs = {render_options.mode};
+    auto images = RenderOutputs(prepared_scene, prep, single);
+    return std::move(images.at(render_options.mode));
+}
+
+// Traces rows [begin, begin + strip.Height()) of the buffer of render_options.mode, which
+// TraceImage would give without anti-aliasing, into strip.
+void TraceStrip(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                const RenderOptions& render_options, int begin, FloatingImage& strip) {
+    RenderTiles(strip, render_options.threads, [&](int i, int j) {
+        return GetPixelValue(scene, Shot(scene, camera_options.EmitRay(begin + i, j)),
+                             render_options.mode, render_options.depth, render_options.termination);
+    });
+}
+
+// WriteFinishedImage(TraceImage(...)) without a buffer of the whole frame: the image is traced
+// and written a strip of rows at a time. Full renders and depth maps need the largest value of
+// the frame first, so they trace it twice, the first time only to find that value.
+void StreamImage(const PreparedScene& scene, const PreparedCameraOptions& camera_options,
+                 const RenderOptions& render_options, const std::filesystem::path& path) {
+    int width = camera_options.options.screen_width;
+    int height = camera_options.options.screen_height;
+    auto mode = render_options.mode;
+    int threads = render_options.threads;
+    auto for_each_strip = [&](auto&& strip_func) {
+        for (int begin = 0; begin < height; begin += FloatingImage::kStripRows) {
+            FloatingImage strip(width, std::min(FloatingImage::kStripRows, height - begin));
+            TraceStrip(scene, camera_options, render_options, begin, strip);
+            strip_func(strip);
+        }
+    };
+
+    double max = 0;
+    if (mode == RenderMode::kFull || mode == RenderMode::kDepth) {
+        for_each_strip([&](const FloatingImage& strip) {
+            max = std::max(max, mode == RenderMode::kDepth ? GetMaxDistance(strip)
+                                                           : strip.GetMax(threads));
+        });
+    }
+    PngWriter writer{path, width, height};
+    for_each_strip([&](FloatingImage& strip) {
+        if (mode == RenderMode::kFull) {
+            strip.AppendDisplayRows(writer, max, threads);
+            return;
+        }
+        if (mode == RenderMode::kDepth) {
+            NormalizeDepth(strip, max);
+        }
+        strip.AppendImageRows(writer, threads);
+    });
+    writer.Finish();
+}
+
+// Render(path, camera_options, render_options).Write(output_path), but the frame is traced and
+// written a strip at a time, so that no full size buffer is held. Anti-aliasing compares pixels
+// across strips and the wavefront tracer traces its own waves, so full renders with either of
+// them keep the traced buffer and only skip building the final image.
+void RenderToFile(const std::filesystem::path& path, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, const std::filesystem::path& output_path) {
+    auto scene = LoadScene(path, render_options);
+    PreparedScene prepared_scene{scene, render_options};
+    PreparedCameraOptions prep{camera_options};
+    if (render_options.mode == RenderMode::kFull &&
+        (render_options.aa_samples > 1 || render_options.wavefront)) {
+        auto res = TraceImage(prepared_scene, prep, render_options);
+        WriteFinishedImage(res, render_options.mode, render_options.threads, output_path);
+        return;
+    }
+    StreamImage(prepared_scene, prep, render_options, output_path);
+}
+
+struct RenderResult {
+    Image image;
+    RenderStats stats;
+};
+
+// Render that also reports how many rays and intersection tests the frame took and how long each
+// stage ran. Only the work of this render is counted, even if others run at the same time.
+RenderResult RenderWithStats(const std::filesystem::path& path,
+                             const CameraOptions& camera_options,
+                             const RenderOptions& render_options) {
+    using Clock = std::chrono::steady_clock;
+    RayCounterSink sink;
+    RayCounterScope scope{&sink};
+
+    auto start = Clock::now();
+    auto scene = LoadScene(path, render_options);
+    auto loaded = Clock::now();
+    PreparedScene prepared_scene{scene, render_options};
+    auto built = Clock::now();
+
+    PreparedCameraOptions prep{camera_options};
+    auto res = TraceImage(prepared_scene, prep, render_options);
+    auto traced = Clock::now();
+    auto image = FinishImage(res, render_options.mode, render_options.threads);
+    auto finished = Clock::now();
+
+    RenderStats stats{.rays = sink.Get(),
+                      .load_time = loaded - start,
+                      .build_time = built - loaded,
+                      .trace_time = traced - built,
+                      .post_time = finished - traced};
+    return RenderResult{std::move(image), stats};
+}
+
+// One view of a batch render.
+struct RenderView {
+    CameraOptions camera_options;
+    RenderOptions render_options;
+};
+
+// Renders every view of the scene, the i-th image is what Render gives for the i-th view. The
+// scene and its BVH are shared by all views, and the tiles of all views are scheduled on the
+// pool together, so a batch of small frames still keeps every thread busy. The threads field of
+// the views' render options is ignored in favour of threads.
+std::vector<Image> RenderBatch(const PreparedScene& scene, const std::vector<RenderView>& views,
+                               int threads = 0) {
+    struct BatchTile {
+        size_t view;
+        Tile tile;
+    };
+    std::vector<PreparedCameraOptions> cameras;
+    std::vector<FloatingImage> images;
+    std::vector<BatchTile> tiles;
+    for (size_t view = 0; view < views.size(); ++view) {
+        const auto& camera_options = views[view].camera_options;
+        cameras.emplace_back(camera_options);
+        images.emplace_back(camera_options.screen_width, camera_options.screen_height);
+        for (const auto& tile :
+             SplitIntoTiles(camera_options.screen_width, camera_options.screen_height)) {
+            tiles.push_back({view, tile});
+        }
+    }
+
+    ParallelTrace(tiles.size(), threads, [&](size_t index) {
+        auto [view, tile] = tiles[index];
+        const auto& camera = cameras[view];
+        const auto& render_options = views[view].render_options;
+        RenderTile(images[view], tile, [&](int i, int j) {
+            return GetPixelValue(scene, Shot(scene, camera.EmitRay(i, j)), render_options.mode,
+                                 render_options.depth, render_options.termination);
+        });
+    });
+
+    std::vector<Image> res;
+    res.reserve(views.size());
+    for (size_t view = 0; view < views.size(); ++view) {
+        auto render_options = views[view].render_options;
+        if (render_options.mode == RenderMode::kFull) {
+            render_options.threads = threads;
+            RefineEdges(scene, cameras[view], render_options, images[view]);
+        }
+        res.push_back(FinishImage(images[view], render_options.mode, threads));
+    }
+    return res;
+}
+
+// Reads the scene once and renders all views of it, see above.
+std::vector<Image> RenderBatch(const std::filesystem::path& path,
+                               const std::vector<RenderView>& views, int threads = 0) {
+    bool scene_cache = std::ranges::any_of(
+        views, [](const RenderView& view) { return view.render_options.scene_cache; });
+    // One BVH serves all views, so it is built as well as any of them asks for.
+    RenderOptions prepare_options;
+    prepare_options.threads = threads;
+    if (!views.empty()) {
+        prepare_options.bvh_quality = views[0].render_options.bvh_quality;
+    }
+    for (const auto& view : views) {
+        prepare_options.float_geometry |= view.render_options.float_geometry;
+        prepare_options.bvh_quality =
+            std::max(prepare_options.bvh_quality, view.render_options.bvh_quality);
+    }
+    auto scene = scene_cache ? ReadSceneCached(path) : ReadScene(path);
+    PreparedScene prepared_scene{scene, prepare_options};
+    return RenderBatch(prepared_scene, views, threads);
 }
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+struct RayCounters {
+    uint64_t primary_rays = 0;
+    uint64_t shadow_rays = 0;
+    uint64_t reflection_rays = 0;
+    uint64_t refraction_rays = 0;
+    uint64_t triangle_tests = 0;
+    uint64_t sphere_tests = 0;
+    uint64_t bvh_node_visits = 0;
+
+    RayCounters& operator+=(const RayCounters& other) {
+        primary_rays += other.primary_rays;
+        shadow_rays += other.shadow_rays;
+        reflection_rays += other.reflection_rays;
+        refraction_rays += other.refraction_rays;
+        triangle_tests += other.triangle_tests;
+        sphere_tests += other.sphere_tests;
+        bvh_node_visits += other.bvh_node_visits;
+        return *this;
+    }
+
+    friend RayCounters operator-(RayCounters a, const RayCounters& b) {
+        a.primary_rays -= b.primary_rays;
+        a.shadow_rays -= b.shadow_rays;
+        a.reflection_rays -= b.reflection_rays;
+        a.refraction_rays -= b.refraction_rays;
+        a.triangle_tests -= b.triangle_tests;
+        a.sphere_tests -= b.sphere_tests;
+        a.bvh_node_visits -= b.bvh_node_visits;
+        return a;
+    }
+};
+
+// Where a render spends its work and time.
+struct RenderStats {
+    RayCounters rays;
+    std::chrono::nanoseconds load_time{};   // reading the scene
+    std::chrono::nanoseconds build_time{};  // building the BVH and triangle packets
+    std::chrono::nanoseconds trace_time{};
+    std::chrono::nanoseconds post_time{};  // normalization, tone mapping, quantization
+};
+
+// Counters of the calling thread. The tracing code bumps them without any synchronization.
+RayCounters& GetThreadRayCounters() {
+    thread_local RayCounters counters;
+    return counters;
+}
+
+// Sums up counters reported from any thread.
+class RayCounterSink {
+public:
+    void Add(const RayCounters& counters) {
+        std::lock_guard lock{mutex_};
+        total_ += counters;
+    }
+
+    RayCounters Get() const {
+        std::lock_guard lock{mutex_};
+        return total_;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    RayCounters total_;
+};
+
+// Sink of the render running on this thread, nullptr if nobody collects counters.
+RayCounterSink*& GetThreadRayCounterSink() {
+    thread_local RayCounterSink* sink = nullptr;
+    return sink;
+}
+
+// Makes the sink collect the counters of all tracing started from this thread while alive.
+class RayCounterScope {
+public:
+    explicit RayCounterScope(RayCounterSink* sink) : previous_(GetThreadRayCounterSink()) {
+        GetThreadRayCounterSink() = sink;
+    }
+
+    ~RayCounterScope() {
+        GetThreadRayCounterSink() = previous_;
+    }
+
+    RayCounterScope(const RayCounterScope&) = delete;
+    RayCounterScope& operator=(const RayCounterScope&) = delete;
+
+private:
+    RayCounterSink* previous_;
+};
+
+// ParallelFor for tracing work. If the calling thread has a sink, whatever counters each task
+// adds on the worker that runs it are reported to that sink, so a render gets exactly its own
+// counts even with other renders running concurrently.
+template <class Func>
+void ParallelTrace(size_t count, int threads, Func&& func) {
+    auto* sink = GetThreadRayCounterSink();
+    if (!sink) {
+        ParallelFor(count, threads, func);
+        return;
+    }
+    ParallelFor(count, threads, [&](size_t index) {
+        auto before = GetThreadRayCounters();
+        func(index);
+        sink->Add(GetThreadRayCounters() - before);
+    });
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "bvh.h"
+#include "object.h"
+#include "ray.h"
+#include "triangle_packet.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+// Up to kPacketSize spheres in structure-of-arrays layout. Unused lanes are left zero, callers
+// only look at the first count lanes.
+struct SpherePacket {
+    alignas(32) std::array<std::array<double, kPacketSize>, 3> center{};
+    alignas(32) std::array<double, kPacketSize> radius_sq{};
+    std::array<uint32_t, kPacketSize> index{};
+    uint32_t count = 0;
+
+    void Add(const Sphere& sphere, uint32_t object_index) {
+        for (size_t axis = 0; axis < 3; ++axis) {
+            center[axis][count] = sphere.GetCenter()[axis];
+        }
+        radius_sq[count] = sphere.GetRadius() * sphere.GetRadius();
+        index[count++] = object_index;
+    }
+};
+
+// GetIntersectionDistance(const Ray&, const Sphere&) against all lanes of the packet at once,
+// the same operations in the same order, so the distances are the same bit for bit when neither
+// is contracted into FMA (see setup_target). Lanes that miss get infinity.
+std::array<double, kPacketSize> GetIntersectionDistances(const Ray& ray,
+                                                         const SpherePacket& packet) {
+    const Vector& o = ray.GetOrigin();
+    const Vector& d = ray.GetDirection();
+    Double4 zero{0.0}, neg_eps{-kEps}, half{0.5}, two{2.0}, four{4.0}, minus_one{-1.0};
+
+    // l = o - c, b = 2 (d . l), c = l . l - r^2
+    Double4 lx = Double4{o[0]} - Double4{packet.center[0].data()};
+    Double4 ly = Double4{o[1]} - Double4{packet.center[1].data()};
+    Double4 lz = Double4{o[2]} - Double4{packet.center[2].data()};
+    Double4 b = two * (zero + Double4{d[0]} * lx + Double4{d[1]} * ly + Double4{d[2]} * lz);
+    Double4 c = (zero + lx * lx + ly * ly + lz * lz) - Double4{packet.radius_sq.data()};
+
+    Double4 disc = b * b - four * c;
+    Double4 miss = disc < neg_eps;
+    Double4 sqrt_disc = Sqrt(Select(zero < disc, disc, zero));
+    Double4 neg_b = b * minus_one;
+    Double4 t0 = (neg_b - sqrt_disc) * half;
+    Double4 t1 = (neg_b + sqrt_disc) * half;
+    Double4 t = Select(t0 < neg_eps, t1, t0);
+    miss = miss | (t < neg_eps);
+
+    Double4 inf{std::numeric_limits<double>::infinity()};
+    alignas(32) std::array<double, kPacketSize> res;
+    Select(miss, inf, t).Store(res.data());
+    return res;
+}
+
+// Scene spheres regrouped into packets along the leaves of a BVH built over them.
+class SpherePackets {
+public:
+    SpherePackets() = default;
+
+    SpherePackets(const std::vector<SphereObject>& spheres, const BVH& bvh) {
+        offsets_.push_back(0);
+        for (uint32_t leaf = 0; leaf < bvh.LeafCount(); ++leaf) {
+            auto primitives = bvh.GetLeaf(leaf);
+            for (size_t i = 0; i < primitives.size(); i += kPacketSize) {
+                auto& packet = packets_.emplace_back();
+                for (size_t j = i; j < std::min(i + kPacketSize, primitives.size()); ++j) {
+                    packet.Add(spheres[primitives[j]].sphere, primitives[j]);
+                }
+            }
+            offsets_.push_back(static_cast<uint32_t>(packets_.size()));
+        }
+    }
+
+    std::span<const SpherePacket> GetLeaf(uint32_t leaf) const {
+        return std::span{packets_}.subspan(offsets_[leaf], offsets_[leaf + 1] - offsets_[leaf]);
+    }
+
+private:
+    std::vector<SpherePacket> packets_;
+    std::vector<uint32_t> offsets_;
+};
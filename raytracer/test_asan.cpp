@@ -5,7 +5,10 @@
 #include "utils.h"
 #include "image.h"
 
+#include <atomic>
 #include <cmath>
+#include <filesystem>
+#include <fstream>
 #include <string_view>
 #include <optional>
 #include <numbers>
@@ -50,6 +53,35 @@ TEST_CASE("Triangle2") {
                "../raytracer/debug/triangle2_debug.png");
 }
 
+TEST_CASE("BVH over spread out boxes") {
+    // A grid of unit cubes with gaps between them, so that many SAH bins are empty. A ray along
+    // a row of cubes must only reach that row, and a ray along a gap must reach nothing.
+    std::vector<BoundingBox> bounds;
+    for (int x = 0; x < 10; ++x) {
+        for (int y = 0; y < 10; ++y) {
+            for (int z = 0; z < 10; ++z) {
+                BoundingBox box;
+                box.Extend(Vector(4. * x, 4. * y, 4. * z));
+                box.Extend(Vector(4. * x + 1, 4. * y + 1, 4. * z + 1));
+                bounds.push_back(box);
+            }
+        }
+    }
+    BVH bvh{bounds};
+    auto count_visits = [&](double offset) {
+        Ray ray{Vector(-5., offset, offset), Vector(1., 0., 0.)};
+        double max_distance = kInf;
+        size_t visits = 0;
+        bvh.Traverse(ray, max_distance, [&](uint32_t, double&) {
+            ++visits;
+            return false;
+        });
+        return visits;
+    };
+    CHECK(count_visits(.5) <= 10);
+    CHECK(count_visits(2.5) == 0);
+}
+
 TEST_CASE("Box with spheres") {
 
     CameraOptions camera_opts{.screen_width = 640,
@@ -60,3 +92,661 @@ TEST_CASE("Box with spheres") {
     CheckImage("box/cube.obj", "box/cube.png", camera_opts, {4},
                "../raytracer/debug/cube_debug.png");
 }
+
+TEST_CASE("Threads") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 320,
+                              .screen_height = 240,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.threads = 1;
+    auto single = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    render_opts.threads = 4;
+    auto multi = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    for (auto y : std::views::iota(0, single.Height())) {
+        for (auto x : std::views::iota(0, single.Width())) {
+            REQUIRE(PixelDistance(single.GetPixel(y, x), multi.GetPixel(y, x)) == 0.);
+        }
+    }
+}
+
+TEST_CASE("Parallel for") {
+    // Every index runs once, also in calls nested in other calls, which share the pool's threads.
+    std::vector<std::atomic<int>> runs(1000);
+    for (int i = 0; i < 3; ++i) {
+        ParallelFor(10, 4, [&](size_t outer) {
+            ParallelFor(100, 4, [&](size_t inner) { ++runs[outer * 100 + inner]; });
+        });
+    }
+    for (const auto& count : runs) {
+        REQUIRE(count == 3);
+    }
+
+    CHECK_THROWS(ParallelFor(100, 4, [&](size_t i) {
+        if (i == 0) {
+            throw std::runtime_error{"task failed"};
+        }
+    }));
+    // The pool is still usable after an exception.
+    std::atomic<int> sum = 0;
+    ParallelFor(100, 4, [&](size_t i) { sum += i; });
+    CHECK(sum == 4950);
+}
+
+TEST_CASE("Triangle packet") {
+    RandomGenerator rnd;
+    auto gen_vector = [&rnd] {
+        auto a = rnd.GenRealArray<3>(-1., 1.);
+        return Vector{a[0], a[1], a[2]};
+    };
+    for (auto iteration = 0; iteration < 1000; ++iteration) {
+        std::vector<Triangle> triangles;
+        TrianglePacket packet;
+        auto count = rnd.GenInt(1, 4);
+        for (auto i = 0; i < count; ++i) {
+            triangles.emplace_back(gen_vector(), gen_vector(), gen_vector());
+            packet.Add(triangles.back(), i);
+        }
+        Ray ray{gen_vector() * 3., gen_vector()};
+        auto distances = GetIntersectionDistances(ray, packet);
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            auto expected = GetIntersectionDistance(ray, triangles[i]);
+            REQUIRE(distances[i] == expected.value_or(kInf));
+        }
+    }
+}
+
+TEST_CASE("Sphere packet") {
+    RandomGenerator rnd;
+    auto gen_vector = [&rnd] {
+        auto a = rnd.GenRealArray<3>(-1., 1.);
+        return Vector{a[0], a[1], a[2]};
+    };
+    for (auto iteration = 0; iteration < 1000; ++iteration) {
+        std::vector<Sphere> spheres;
+        SpherePacket packet;
+        auto count = rnd.GenInt(1, 4);
+        for (auto i = 0; i < count; ++i) {
+            spheres.emplace_back(gen_vector(), rnd.GenRealArray<1>(0., 1.)[0]);
+            packet.Add(spheres.back(), i);
+        }
+        Ray ray{gen_vector() * 3., gen_vector()};
+        auto distances = GetIntersectionDistances(ray, packet);
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            auto expected = GetIntersectionDistance(ray, spheres[i]);
+            REQUIRE(distances[i] == expected.value_or(kInf));
+        }
+    }
+}
+
+TEST_CASE("Float triangle packet") {
+    RandomGenerator rnd;
+    auto gen_vector = [&rnd] {
+        auto a = rnd.GenRealArray<3>(-1., 1.);
+        return Vector{a[0], a[1], a[2]};
+    };
+    for (auto iteration = 0; iteration < 1000; ++iteration) {
+        std::vector<Triangle> triangles;
+        FloatTrianglePacket packet;
+        auto count = rnd.GenInt(1, 8);
+        for (auto i = 0; i < count; ++i) {
+            triangles.emplace_back(gen_vector(), gen_vector(), gen_vector());
+            packet.Add(triangles.back(), i);
+        }
+        Ray ray{gen_vector() * 3., gen_vector()};
+        auto distances = GetIntersectionDistances(ray, packet);
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            // Float lanes only pick candidates, they must not lose a hit or be far off.
+            if (auto expected = GetIntersectionDistance(ray, triangles[i])) {
+                REQUIRE(std::abs(distances[i] - *expected) <= 1e-3 * (1 + *expected));
+            }
+        }
+    }
+}
+
+TEST_CASE("Progressive") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 150,
+                              .screen_height = 100,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    std::vector<int> steps;
+    auto progressive = RenderProgressive(
+        kTestsDir / "box/cube.obj", camera_opts, render_opts,
+        [&steps](const FloatingImage& image, int step) {
+            CHECK(image.Width() == 150);
+            steps.push_back(step);
+        });
+    CHECK(steps == std::vector{8, 4, 2, 1});
+
+    auto full = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    for (auto y : std::views::iota(0, full.Height())) {
+        for (auto x : std::views::iota(0, full.Width())) {
+            REQUIRE(PixelDistance(full.GetPixel(y, x), progressive.GetPixel(y, x)) == 0.);
+        }
+    }
+}
+
+TEST_CASE("Batch") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    std::vector<RenderView> views;
+    for (auto mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kNormal}) {
+        for (auto x : {-.5, .5}) {
+            CameraOptions camera_opts{.screen_width = 120,
+                                      .screen_height = 80,
+                                      .fov = std::numbers::pi / 3,
+                                      .look_from = {x, .7, 1.75},
+                                      .look_to = {0., .7, 0.}};
+            views.push_back({camera_opts, {.depth = 4, .mode = mode}});
+        }
+    }
+    auto images = RenderBatch(kTestsDir / "box/cube.obj", views, 4);
+    REQUIRE(images.size() == views.size());
+    for (size_t i = 0; i < views.size(); ++i) {
+        auto expected = Render(kTestsDir / "box/cube.obj", views[i].camera_options,
+                               views[i].render_options);
+        for (auto y : std::views::iota(0, expected.Height())) {
+            for (auto x : std::views::iota(0, expected.Width())) {
+                REQUIRE(PixelDistance(expected.GetPixel(y, x), images[i].GetPixel(y, x)) == 0.);
+            }
+        }
+    }
+}
+
+TEST_CASE("Outputs") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 150,
+                              .screen_height = 100,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.outputs = {RenderMode::kFull, RenderMode::kNormal, RenderMode::kDepth,
+                           RenderMode::kAlbedo, RenderMode::kNormal};
+    auto images = RenderOutputs(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    REQUIRE(images.size() == 4);
+
+    for (auto mode : {RenderMode::kFull, RenderMode::kNormal, RenderMode::kDepth,
+                      RenderMode::kAlbedo}) {
+        render_opts.mode = mode;
+        auto expected = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+        const auto& image = images.at(mode);
+        for (auto y : std::views::iota(0, expected.Height())) {
+            for (auto x : std::views::iota(0, expected.Width())) {
+                REQUIRE(PixelDistance(expected.GetPixel(y, x), image.GetPixel(y, x)) == 0.);
+            }
+        }
+    }
+}
+
+TEST_CASE("Display image") {
+    RandomGenerator rnd;
+    FloatingImage image(256, 300);
+    for (auto i = 0; i < image.Height(); ++i) {
+        for (auto j = 0; j < image.Width(); ++j) {
+            auto a = rnd.GenRealArray<3>(0., 1.);
+            image.SetPixel(i, j, {a[0], a[1], a[2]});
+        }
+    }
+    // Pixels right at the boundaries between output levels. The brightest channel is 1, so tone
+    // mapping leaves the values next to unchanged.
+    for (auto j = 0; j < image.Width(); ++j) {
+        double x = std::pow(j / 255., 2.2);
+        image.SetPixel(0, j, {x, std::nextafter(x, 0.), std::nextafter(x, 1.)});
+    }
+    image.SetPixel(1, 0, {1., 0., -1.});
+    image.SetPixel(1, 1, {std::nan(""), 0., 0.});
+
+    auto fused = image.ToDisplayImage(4);
+    image.ToneMapping();
+    image.GammaCorrection();
+    auto expected = image.ToImage();
+    for (auto y : std::views::iota(0, expected.Height())) {
+        for (auto x : std::views::iota(0, expected.Width())) {
+            REQUIRE(PixelDistance(expected.GetPixel(y, x), fused.GetPixel(y, x)) == 0.);
+        }
+    }
+}
+
+TEST_CASE("Adaptive anti-aliasing") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.aa_samples = 4;
+    render_opts.aa_budget = 0.1;
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    PreparedScene prepared{scene};
+    PreparedCameraOptions camera{camera_opts};
+    FloatingImage image(camera_opts.screen_width, camera_opts.screen_height);
+    RenderTiles(image, render_opts.threads,
+                [&](int i, int j) { return TraceFull(prepared, camera, render_opts, i, j); });
+    const auto traced = image;
+    auto refined = RefineEdges(prepared, camera, render_opts, image);
+    CHECK(refined > 0);
+    CHECK(refined <= 160 * 120 / 10);
+
+    // Only the pixels traced again may change.
+    size_t changed = 0;
+    for (auto y : std::views::iota(0, image.Height())) {
+        for (auto x : std::views::iota(0, image.Width())) {
+            auto a = traced.GetPixel(y, x);
+            auto b = image.GetPixel(y, x);
+            changed += a.r != b.r || a.g != b.g || a.b != b.b;
+        }
+    }
+    CHECK(changed > 0);
+    CHECK(changed <= refined);
+
+    // Colors compressed to [0, 1) never differ by more than 1.
+    render_opts.aa_threshold = 1.;
+    CHECK(RefineEdges(prepared, camera, render_opts, image) == 0);
+}
+
+TEST_CASE("Render stats") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 120,
+                              .screen_height = 80,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.threads = 4;
+    auto [image, stats] = RenderWithStats(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    auto expected = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    for (auto y : std::views::iota(0, expected.Height())) {
+        for (auto x : std::views::iota(0, expected.Width())) {
+            REQUIRE(PixelDistance(expected.GetPixel(y, x), image.GetPixel(y, x)) == 0.);
+        }
+    }
+
+    const auto& rays = stats.rays;
+    CHECK(rays.primary_rays == 120 * 80);
+    CHECK(rays.shadow_rays > rays.primary_rays);
+    CHECK(rays.reflection_rays > 0);
+    CHECK(rays.refraction_rays > 0);
+    CHECK(rays.triangle_tests > 0);
+    CHECK(rays.bvh_node_visits > 0);
+    // The spheres are only tested by rays entering their box.
+    CHECK(rays.sphere_tests > 0);
+    CHECK(rays.sphere_tests < 2 * (rays.primary_rays + rays.shadow_rays));
+    CHECK(stats.trace_time.count() > 0);
+
+    // The counts don't depend on how the work is split between threads.
+    render_opts.threads = 1;
+    auto single = RenderWithStats(kTestsDir / "box/cube.obj", camera_opts, render_opts).stats.rays;
+    CHECK(single.primary_rays == rays.primary_rays);
+    CHECK(single.shadow_rays == rays.shadow_rays);
+    CHECK(single.reflection_rays == rays.reflection_rays);
+    CHECK(single.refraction_rays == rays.refraction_rays);
+    CHECK(single.triangle_tests == rays.triangle_tests);
+    CHECK(single.sphere_tests == rays.sphere_tests);
+    CHECK(single.bvh_node_visits == rays.bvh_node_visits);
+}
+
+TEST_CASE("Glass chain") {
+    // A long row of transparent spheres in front of the camera: every primary ray refracts
+    // through all of them, which takes more generations than a render follows.
+    const auto dir = std::filesystem::temp_directory_path() / "test_raytracer_glass_chain";
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "glass.mtl") << "newmtl glass\nKd 0.1 0.1 0.1\nal 0 0 1\nNi 1\n";
+    {
+        std::ofstream scene(dir / "scene.obj");
+        scene << "mtllib glass.mtl\nusemtl glass\nP 0 10 0 1 1 1\n";
+        for (int k = 1; k <= 3 * kMaxRayGeneration; ++k) {
+            scene << "S 0 0 " << -2 * k << " 0.5\n";
+        }
+    }
+    CameraOptions camera_opts{.screen_width = 3,
+                              .screen_height = 3,
+                              .fov = 0.001,
+                              .look_from = {0., 0., 0.},
+                              .look_to = {0., 0., -1.}};
+    auto stats = RenderWithStats(dir / "scene.obj", camera_opts, {0}).stats;
+    std::filesystem::remove_all(dir);
+
+    // Every generation is the refraction through a sphere, counted once on entry and once on exit.
+    CHECK(stats.rays.primary_rays == 9);
+    CHECK(stats.rays.refraction_rays == 9 * 2 * kMaxRayGeneration);
+}
+
+TEST_CASE("Wavefront") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.threads = 4;
+    auto expected = RenderWithStats(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    render_opts.wavefront = true;
+    auto wavefront = RenderWithStats(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    Compare(wavefront.image, expected.image);
+
+    // The same rays are traced, just in another order.
+    const auto& rays = wavefront.stats.rays;
+    const auto& expected_rays = expected.stats.rays;
+    CHECK(rays.primary_rays == expected_rays.primary_rays);
+    CHECK(rays.shadow_rays == expected_rays.shadow_rays);
+    CHECK(rays.reflection_rays == expected_rays.reflection_rays);
+    CHECK(rays.refraction_rays == expected_rays.refraction_rays);
+    CHECK(rays.sphere_tests == expected_rays.sphere_tests);
+    CHECK(rays.triangle_tests == expected_rays.triangle_tests);
+
+    // Sorting is deterministic, so is the result.
+    render_opts.threads = 1;
+    auto single = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    for (auto y : std::views::iota(0, single.Height())) {
+        for (auto x : std::views::iota(0, single.Width())) {
+            REQUIRE(PixelDistance(single.GetPixel(y, x), wavefront.image.GetPixel(y, x)) == 0.);
+        }
+    }
+}
+
+TEST_CASE("Float geometry") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    auto expected = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    render_opts.float_geometry = true;
+    auto image = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    // Hits are confirmed in double precision, so the images match.
+    for (auto y : std::views::iota(0, expected.Height())) {
+        for (auto x : std::views::iota(0, expected.Width())) {
+            REQUIRE(PixelDistance(image.GetPixel(y, x), expected.GetPixel(y, x)) == 0.);
+        }
+    }
+}
+
+TEST_CASE("Instances") {
+    // The same scene twice: blocks placed as instances of one file, and the transformed blocks
+    // written out as plain faces.
+    const auto dir = std::filesystem::temp_directory_path() / "test_raytracer_instances";
+    std::filesystem::create_directories(dir / "models");
+    std::ofstream(dir / "models/block.mtl") << "newmtl red\nKd 0.8 0.1 0.1\nKs 0.5 0.5 0.5\n"
+                                               "Ns 20\nal 0.7 0.3 0\n"
+                                               "newmtl floor\nKd 0.6 0.6 0.6\n";
+    const std::vector<Vector> corners{{-.5, -.5, -.5}, {.5, -.5, -.5}, {.5, .5, -.5},
+                                      {-.5, .5, -.5},  {-.5, -.5, .5}, {.5, -.5, .5},
+                                      {.5, .5, .5},    {-.5, .5, .5}};
+    const std::string faces =
+        "f 1 4 3 2\nf 5 6 7 8\nf 1 2 6 5\nf 4 8 7 3\nf 1 5 8 4\nf 2 3 7 6\n";
+    const std::string header =
+        "mtllib models/block.mtl\nP 0 4 2 1 1 1\nP -3 3 3 .5 .5 .5\nusemtl floor\n"
+        "v -5 0 -5\nv 5 0 -5\nv 5 0 5\nv -5 0 5\nf 1 4 3 2\nusemtl red\n";
+    {
+        std::ofstream block(dir / "models/block.obj");
+        block << "mtllib block.mtl\nusemtl red\n";
+        for (const auto& p : corners) {
+            block << "v " << p[0] << ' ' << p[1] << ' ' << p[2] << '\n';
+        }
+        block << faces;
+    }
+
+    const double c = std::cos(.8) * .7;
+    const double s = std::sin(.8) * .7;
+    const std::vector<Transform> transforms{
+        Transform::Translation({-1.2, .5, 0}),
+        Transform{{Vector{c, 0, s}, Vector{0, .5, 0}, Vector{-s, 0, c}}, {0, .25, -.5}},
+        Transform::Translation({1.2, .5, .3})};
+    {
+        std::ofstream instanced(dir / "instanced.obj");
+        instanced << header;
+        instanced.precision(17);
+        for (const auto& transform : transforms) {
+            instanced << "I models/block.obj";
+            for (size_t i = 0; i < 3; ++i) {
+                const auto& row = transform.GetRow(i);
+                instanced << ' ' << row[0] << ' ' << row[1] << ' ' << row[2] << ' '
+                          << transform.GetTranslation()[i];
+            }
+            instanced << '\n';
+        }
+    }
+    {
+        std::ofstream flat(dir / "flat.obj");
+        flat << header;
+        flat.precision(17);
+        for (const auto& transform : transforms) {
+            for (const auto& corner : corners) {
+                auto p = transform.ApplyToPoint(corner);
+                flat << "v " << p[0] << ' ' << p[1] << ' ' << p[2] << '\n';
+            }
+            // Relative indices pick the 8 vertexes just written.
+            for (char ch : faces) {
+                if ('1' <= ch && ch <= '8') {
+                    flat << '-' << 9 - (ch - '0');
+                } else {
+                    flat << ch;
+                }
+            }
+        }
+    }
+
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .look_from = {0., 2.5, 3.5},
+                              .look_to = {0., .3, 0.}};
+    RenderOptions render_opts{4};
+    auto scene = ReadScene(dir / "instanced.obj");
+    auto expected = Render(dir / "flat.obj", camera_opts, render_opts);
+    auto instanced = Render(dir / "instanced.obj", camera_opts, render_opts);
+    std::filesystem::remove_all(dir);
+
+    // The geometry of the block is stored and prepared once.
+    CHECK(scene.GetMesh().Size() == 2);
+    CHECK(scene.GetPrototypes().size() == 1);
+    PreparedScene prepared{scene};
+    CHECK(prepared.prototypes.size() == 1);
+    Compare(instanced, expected);
+}
+
+TEST_CASE("Many spheres") {
+    // A cloud of spheres, some of them overlapping. Shot must find what a scan over all of them
+    // finds while testing only a small part of them.
+    const auto dir = std::filesystem::temp_directory_path() / "test_raytracer_many_spheres";
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "cloud.mtl") << "newmtl white\nKd 1 1 1\n";
+    RandomGenerator rnd;
+    {
+        std::ofstream scene(dir / "cloud.obj");
+        scene << "mtllib cloud.mtl\nusemtl white\nP 0 10 10 1 1 1\n";
+        for (int k = 0; k < 2000; ++k) {
+            auto c = rnd.GenRealArray<3>(-5., 5.);
+            auto r = rnd.GenRealArray<1>(.05, .3)[0];
+            scene << "S " << c[0] << ' ' << c[1] << ' ' << c[2] << ' ' << r << '\n';
+        }
+    }
+    auto scene = ReadScene(dir / "cloud.obj");
+    std::filesystem::remove_all(dir);
+    PreparedScene prepared{scene};
+    PreparedCameraOptions camera{CameraOptions{.screen_width = 40,
+                                               .screen_height = 30,
+                                               .look_from = {0., 0., 12.},
+                                               .look_to = {0., 0., 0.}}};
+    auto before = GetThreadRayCounters();
+    for (int i = 0; i < 30; ++i) {
+        for (int j = 0; j < 40; ++j) {
+            auto ray = camera.EmitRay(i, j);
+            auto hit = Shot(prepared, ray);
+            std::optional<size_t> expected;
+            double distance = kInf;
+            const auto& spheres = scene.GetSphereObjects();
+            for (size_t k = 0; k < spheres.size(); ++k) {
+                auto x = GetIntersectionDistance(ray, spheres[k].sphere);
+                if (x && *x <= distance) {
+                    expected = k;
+                    distance = *x;
+                }
+            }
+            REQUIRE(hit.has_value() == expected.has_value());
+            if (hit) {
+                REQUIRE(hit->sphere == &spheres[*expected]);
+                REQUIRE(hit->distance == distance);
+            }
+        }
+    }
+    auto tests = (GetThreadRayCounters() - before).sphere_tests;
+    CHECK(tests > 0);
+    CHECK(tests < 30 * 40 * 2000 / 20);
+}
+
+TEST_CASE("BVH quality") {
+    // A soup of triangles big enough for the parallel parts of the build to be split into
+    // several chunks and subtrees.
+    RandomGenerator rnd;
+    std::vector<BoundingBox> bounds;
+    for (int k = 0; k < 40000; ++k) {
+        auto a = rnd.GenRealArray<3>(-10., 10.);
+        auto b = rnd.GenRealArray<3>(-.2, .2);
+        auto c = rnd.GenRealArray<3>(-.2, .2);
+        Vector p{a[0], a[1], a[2]};
+        bounds.push_back(GetBoundingBox(
+            Triangle{p, p + Vector{b[0], b[1], b[2]}, p + Vector{c[0], c[1], c[2]}}));
+    }
+
+    std::map<BVHQuality, double> costs;
+    for (auto quality : {BVHQuality::kFast, BVHQuality::kMedium, BVHQuality::kHigh}) {
+        BVH sequential{bounds, {.quality = quality, .threads = 1}};
+        BVH parallel{bounds, {.quality = quality, .threads = 4}};
+        // The tree doesn't depend on the number of threads.
+        REQUIRE(parallel.NodeCount() == sequential.NodeCount());
+        REQUIRE(parallel.LeafCount() == sequential.LeafCount());
+        CHECK(parallel.GetSahCost() == sequential.GetSahCost());
+        std::vector<int> seen(bounds.size());
+        for (uint32_t leaf = 0; leaf < sequential.LeafCount(); ++leaf) {
+            auto expected = sequential.GetLeaf(leaf);
+            auto leaf_primitives = parallel.GetLeaf(leaf);
+            REQUIRE(std::ranges::equal(leaf_primitives, expected));
+            for (auto index : leaf_primitives) {
+                ++seen[index];
+            }
+        }
+        CHECK(std::ranges::all_of(seen, [](int count) { return count == 1; }));
+        costs[quality] = sequential.GetSahCost();
+    }
+    CHECK(costs[BVHQuality::kMedium] < costs[BVHQuality::kFast]);
+    CHECK(costs[BVHQuality::kHigh] < costs[BVHQuality::kMedium] * 1.05);
+
+    // Only the speed depends on the tree, not the image.
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    auto expected = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    for (auto quality : {BVHQuality::kFast, BVHQuality::kHigh}) {
+        render_opts.bvh_quality = quality;
+        auto image = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+        for (auto y : std::views::iota(0, expected.Height())) {
+            for (auto x : std::views::iota(0, expected.Width())) {
+                REQUIRE(PixelDistance(image.GetPixel(y, x), expected.GetPixel(y, x)) == 0.);
+            }
+        }
+    }
+}
+
+TEST_CASE("Render to file") {
+    // The png written strip by strip is the one Render gives, for a height that isn't a
+    // multiple of the strip. Anti-aliased renders keep the traced buffer and must match too.
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    const auto path = std::filesystem::temp_directory_path() / "test_raytracer_render_to_file.png";
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 75,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    const std::pair<RenderMode, int> kCases[] = {{RenderMode::kFull, 1},
+                                                 {RenderMode::kDepth, 1},
+                                                 {RenderMode::kNormal, 1},
+                                                 {RenderMode::kAlbedo, 1},
+                                                 {RenderMode::kFull, 4}};
+    for (auto [mode, aa_samples] : kCases) {
+        RenderOptions render_opts{4};
+        render_opts.mode = mode;
+        render_opts.aa_samples = aa_samples;
+        auto expected = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+        RenderToFile(kTestsDir / "box/cube.obj", camera_opts, render_opts, path);
+        Image image{path};
+        REQUIRE(image.Width() == expected.Width());
+        REQUIRE(image.Height() == expected.Height());
+        for (auto y : std::views::iota(0, expected.Height())) {
+            for (auto x : std::views::iota(0, expected.Width())) {
+                auto [r, g, b] = image.GetPixel(y, x);
+                auto [er, eg, eb] = expected.GetPixel(y, x);
+                REQUIRE(r == er);
+                REQUIRE(g == eg);
+                REQUIRE(b == eb);
+            }
+        }
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Ray termination") {
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .look_from = {2., 1.5, -.1},
+                              .look_to = {1., 1.2, -2.8}};
+    auto scene = ReadScene(kTestsDir / "mirrors/scene.obj");
+    PreparedScene prepared{scene};
+    PreparedCameraOptions camera{camera_opts};
+    auto trace = [&](const RenderOptions& render_opts) {
+        auto before = GetThreadRayCounters().reflection_rays;
+        auto image = TraceFullImage(prepared, camera, render_opts);
+        double sum = 0;
+        for (auto y : std::views::iota(0, image.Height())) {
+            for (auto x : std::views::iota(0, image.Width())) {
+                auto [r, g, b] = image.GetPixel(y, x);
+                sum += r + g + b;
+            }
+        }
+        return std::tuple{std::move(image), sum, GetThreadRayCounters().reflection_rays - before};
+    };
+
+    RenderOptions render_opts{9};
+    render_opts.threads = 1;
+    auto [full, full_sum, full_rays] = trace(render_opts);
+
+    // Dropping light rays saves rays and loses their light.
+    render_opts.termination = {.min_weight = .5};
+    auto [dropped, dropped_sum, dropped_rays] = trace(render_opts);
+    CHECK(dropped_rays < full_rays);
+    CHECK(dropped_sum < full_sum * .95);
+
+    // Russian roulette saves rays too, but keeps the light on average.
+    render_opts.termination.russian_roulette = true;
+    auto [roulette, roulette_sum, roulette_rays] = trace(render_opts);
+    CHECK(roulette_rays < full_rays);
+    CHECK(std::abs(roulette_sum - full_sum) < full_sum * .02);
+
+    // The draws don't depend on the threads or the order rays are traced in.
+    render_opts.threads = 4;
+    auto threaded = std::get<0>(trace(render_opts));
+    render_opts.wavefront = true;
+    auto wavefront = std::get<0>(trace(render_opts));
+    for (auto y : std::views::iota(0, full.Height())) {
+        for (auto x : std::views::iota(0, full.Width())) {
+            auto [r, g, b] = roulette.GetPixel(y, x);
+            auto [tr, tg, tb] = threaded.GetPixel(y, x);
+            REQUIRE((r == tr && g == tg && b == tb));
+            auto [wr, wg, wb] = wavefront.GetPixel(y, x);
+            REQUIRE(std::abs(r - wr) + std::abs(g - wg) + std::abs(b - wb) < 1e-9);
+        }
+    }
+}
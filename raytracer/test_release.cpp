@@ -34,7 +34,6 @@ TEST_CASE("Distorted box") {
                "../raytracer/debug/distorted_box.png");
 }
 
-// Too long
 TEST_CASE("Deer") {
 
     CameraOptions camera_opts{.screen_width = 500,
@@ -0,0 +1,462 @@
+#pragma once
+
+#include "bvh.h"
+#include "common.h"
+#include "mesh.h"
+#include "ray.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const size_t kPacketSize = 4;       // lanes of a double packet
+const size_t kFloatPacketSize = 8;  // lanes of a float packet, the same register width
+
+// Four doubles processed together. The instruction set is picked at build time: AVX when the
+// compiler targets it (e.g. -march=native), SSE2 on any x86-64, plain loops everywhere else.
+// Every lane does exactly the operations the scalar code does, so results match it bit for bit
+// as long as the compiler doesn't contract the scalar code into FMA (-ffp-contract=off).
+class Double4 {
+public:
+    Double4() = default;
+
+#if defined(__AVX__)
+    explicit Double4(double x) : v_(_mm256_set1_pd(x)) {
+    }
+    explicit Double4(const double* p) : v_(_mm256_load_pd(p)) {
+    }
+    void Store(double* p) const {
+        _mm256_store_pd(p, v_);
+    }
+    friend Double4 operator+(Double4 a, Double4 b) {
+        return Double4{_mm256_add_pd(a.v_, b.v_)};
+    }
+    friend Double4 operator-(Double4 a, Double4 b) {
+        return Double4{_mm256_sub_pd(a.v_, b.v_)};
+    }
+    friend Double4 operator*(Double4 a, Double4 b) {
+        return Double4{_mm256_mul_pd(a.v_, b.v_)};
+    }
+    friend Double4 operator/(Double4 a, Double4 b) {
+        return Double4{_mm256_div_pd(a.v_, b.v_)};
+    }
+    // Comparisons return all-ones lanes where they hold, all-zeroes otherwise.
+    friend Double4 operator<(Double4 a, Double4 b) {
+        return Double4{_mm256_cmp_pd(a.v_, b.v_, _CMP_LT_OQ)};
+    }
+    friend Double4 operator>(Double4 a, Double4 b) {
+        return Double4{_mm256_cmp_pd(a.v_, b.v_, _CMP_GT_OQ)};
+    }
+    friend Double4 operator|(Double4 a, Double4 b) {
+        return Double4{_mm256_or_pd(a.v_, b.v_)};
+    }
+    friend Double4 operator&(Double4 a, Double4 b) {
+        return Double4{_mm256_and_pd(a.v_, b.v_)};
+    }
+    // Lanes of a where mask is set, lanes of b elsewhere.
+    friend Double4 Select(Double4 mask, Double4 a, Double4 b) {
+        return Double4{_mm256_blendv_pd(b.v_, a.v_, mask.v_)};
+    }
+    friend Double4 Sqrt(Double4 a) {
+        return Double4{_mm256_sqrt_pd(a.v_)};
+    }
+
+private:
+    explicit Double4(__m256d v) : v_(v) {
+    }
+
+    __m256d v_;
+#elif defined(__SSE2__)
+    explicit Double4(double x) : lo_(_mm_set1_pd(x)), hi_(lo_) {
+    }
+    explicit Double4(const double* p) : lo_(_mm_load_pd(p)), hi_(_mm_load_pd(p + 2)) {
+    }
+    void Store(double* p) const {
+        _mm_store_pd(p, lo_);
+        _mm_store_pd(p + 2, hi_);
+    }
+    friend Double4 operator+(Double4 a, Double4 b) {
+        return Double4{_mm_add_pd(a.lo_, b.lo_), _mm_add_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 operator-(Double4 a, Double4 b) {
+        return Double4{_mm_sub_pd(a.lo_, b.lo_), _mm_sub_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 operator*(Double4 a, Double4 b) {
+        return Double4{_mm_mul_pd(a.lo_, b.lo_), _mm_mul_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 operator/(Double4 a, Double4 b) {
+        return Double4{_mm_div_pd(a.lo_, b.lo_), _mm_div_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 operator<(Double4 a, Double4 b) {
+        return Double4{_mm_cmplt_pd(a.lo_, b.lo_), _mm_cmplt_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 operator>(Double4 a, Double4 b) {
+        return Double4{_mm_cmpgt_pd(a.lo_, b.lo_), _mm_cmpgt_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 operator|(Double4 a, Double4 b) {
+        return Double4{_mm_or_pd(a.lo_, b.lo_), _mm_or_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 operator&(Double4 a, Double4 b) {
+        return Double4{_mm_and_pd(a.lo_, b.lo_), _mm_and_pd(a.hi_, b.hi_)};
+    }
+    friend Double4 Select(Double4 mask, Double4 a, Double4 b) {
+        return Double4{_mm_or_pd(_mm_and_pd(mask.lo_, a.lo_), _mm_andnot_pd(mask.lo_, b.lo_)),
+                       _mm_or_pd(_mm_and_pd(mask.hi_, a.hi_), _mm_andnot_pd(mask.hi_, b.hi_))};
+    }
+    friend Double4 Sqrt(Double4 a) {
+        return Double4{_mm_sqrt_pd(a.lo_), _mm_sqrt_pd(a.hi_)};
+    }
+
+private:
+    Double4(__m128d lo, __m128d hi) : lo_(lo), hi_(hi) {
+    }
+
+    __m128d lo_, hi_;
+#else
+    explicit Double4(double x) : v_{x, x, x, x} {
+    }
+    explicit Double4(const double* p) : v_{p[0], p[1], p[2], p[3]} {
+    }
+    void Store(double* p) const {
+        for (size_t i = 0; i < kPacketSize; ++i) {
+            p[i] = v_[i];
+        }
+    }
+    friend Double4 operator+(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x + y; });
+    }
+    friend Double4 operator-(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x - y; });
+    }
+    friend Double4 operator*(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x * y; });
+    }
+    friend Double4 operator/(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x / y; });
+    }
+    friend Double4 operator<(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x < y ? 1.0 : 0.0; });
+    }
+    friend Double4 operator>(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x > y ? 1.0 : 0.0; });
+    }
+    friend Double4 operator|(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x != 0 || y != 0 ? 1.0 : 0.0; });
+    }
+    friend Double4 operator&(Double4 a, Double4 b) {
+        return Apply(a, b, [](double x, double y) { return x != 0 && y != 0 ? 1.0 : 0.0; });
+    }
+    friend Double4 Select(Double4 mask, Double4 a, Double4 b) {
+        for (size_t i = 0; i < kPacketSize; ++i) {
+            a.v_[i] = mask.v_[i] != 0 ? a.v_[i] : b.v_[i];
+        }
+        return a;
+    }
+    friend Double4 Sqrt(Double4 a) {
+        for (size_t i = 0; i < kPacketSize; ++i) {
+            a.v_[i] = std::sqrt(a.v_[i]);
+        }
+        return a;
+    }
+
+private:
+    template <class Op>
+    static Double4 Apply(Double4 a, Double4 b, Op op) {
+        for (size_t i = 0; i < kPacketSize; ++i) {
+            a.v_[i] = op(a.v_[i], b.v_[i]);
+        }
+        return a;
+    }
+
+    std::array<double, kPacketSize> v_;
+#endif
+};
+
+// Eight floats processed together, the same interface as Double4.
+class Float8 {
+public:
+    Float8() = default;
+
+#if defined(__AVX__)
+    explicit Float8(float x) : v_(_mm256_set1_ps(x)) {
+    }
+    explicit Float8(const float* p) : v_(_mm256_load_ps(p)) {
+    }
+    void Store(float* p) const {
+        _mm256_store_ps(p, v_);
+    }
+    friend Float8 operator+(Float8 a, Float8 b) {
+        return Float8{_mm256_add_ps(a.v_, b.v_)};
+    }
+    friend Float8 operator-(Float8 a, Float8 b) {
+        return Float8{_mm256_sub_ps(a.v_, b.v_)};
+    }
+    friend Float8 operator*(Float8 a, Float8 b) {
+        return Float8{_mm256_mul_ps(a.v_, b.v_)};
+    }
+    friend Float8 operator/(Float8 a, Float8 b) {
+        return Float8{_mm256_div_ps(a.v_, b.v_)};
+    }
+    friend Float8 operator<(Float8 a, Float8 b) {
+        return Float8{_mm256_cmp_ps(a.v_, b.v_, _CMP_LT_OQ)};
+    }
+    friend Float8 operator>(Float8 a, Float8 b) {
+        return Float8{_mm256_cmp_ps(a.v_, b.v_, _CMP_GT_OQ)};
+    }
+    friend Float8 operator|(Float8 a, Float8 b) {
+        return Float8{_mm256_or_ps(a.v_, b.v_)};
+    }
+    friend Float8 operator&(Float8 a, Float8 b) {
+        return Float8{_mm256_and_ps(a.v_, b.v_)};
+    }
+    friend Float8 Select(Float8 mask, Float8 a, Float8 b) {
+        return Float8{_mm256_blendv_ps(b.v_, a.v_, mask.v_)};
+    }
+
+private:
+    explicit Float8(__m256 v) : v_(v) {
+    }
+
+    __m256 v_;
+#elif defined(__SSE2__)
+    explicit Float8(float x) : lo_(_mm_set1_ps(x)), hi_(lo_) {
+    }
+    explicit Float8(const float* p) : lo_(_mm_load_ps(p)), hi_(_mm_load_ps(p + 4)) {
+    }
+    void Store(float* p) const {
+        _mm_store_ps(p, lo_);
+        _mm_store_ps(p + 4, hi_);
+    }
+    friend Float8 operator+(Float8 a, Float8 b) {
+        return Float8{_mm_add_ps(a.lo_, b.lo_), _mm_add_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 operator-(Float8 a, Float8 b) {
+        return Float8{_mm_sub_ps(a.lo_, b.lo_), _mm_sub_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 operator*(Float8 a, Float8 b) {
+        return Float8{_mm_mul_ps(a.lo_, b.lo_), _mm_mul_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 operator/(Float8 a, Float8 b) {
+        return Float8{_mm_div_ps(a.lo_, b.lo_), _mm_div_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 operator<(Float8 a, Float8 b) {
+        return Float8{_mm_cmplt_ps(a.lo_, b.lo_), _mm_cmplt_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 operator>(Float8 a, Float8 b) {
+        return Float8{_mm_cmpgt_ps(a.lo_, b.lo_), _mm_cmpgt_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 operator|(Float8 a, Float8 b) {
+        return Float8{_mm_or_ps(a.lo_, b.lo_), _mm_or_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 operator&(Float8 a, Float8 b) {
+        return Float8{_mm_and_ps(a.lo_, b.lo_), _mm_and_ps(a.hi_, b.hi_)};
+    }
+    friend Float8 Select(Float8 mask, Float8 a, Float8 b) {
+        return Float8{_mm_or_ps(_mm_and_ps(mask.lo_, a.lo_), _mm_andnot_ps(mask.lo_, b.lo_)),
+                      _mm_or_ps(_mm_and_ps(mask.hi_, a.hi_), _mm_andnot_ps(mask.hi_, b.hi_))};
+    }
+
+private:
+    Float8(__m128 lo, __m128 hi) : lo_(lo), hi_(hi) {
+    }
+
+    __m128 lo_, hi_;
+#else
+    explicit Float8(float x) {
+        v_.fill(x);
+    }
+    explicit Float8(const float* p) {
+        std::copy(p, p + kFloatPacketSize, v_.begin());
+    }
+    void Store(float* p) const {
+        std::copy(v_.begin(), v_.end(), p);
+    }
+    friend Float8 operator+(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x + y; });
+    }
+    friend Float8 operator-(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x - y; });
+    }
+    friend Float8 operator*(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x * y; });
+    }
+    friend Float8 operator/(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x / y; });
+    }
+    friend Float8 operator<(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x < y ? 1.0f : 0.0f; });
+    }
+    friend Float8 operator>(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x > y ? 1.0f : 0.0f; });
+    }
+    friend Float8 operator|(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x != 0 || y != 0 ? 1.0f : 0.0f; });
+    }
+    friend Float8 operator&(Float8 a, Float8 b) {
+        return Apply(a, b, [](float x, float y) { return x != 0 && y != 0 ? 1.0f : 0.0f; });
+    }
+    friend Float8 Select(Float8 mask, Float8 a, Float8 b) {
+        for (size_t i = 0; i < kFloatPacketSize; ++i) {
+            a.v_[i] = mask.v_[i] != 0 ? a.v_[i] : b.v_[i];
+        }
+        return a;
+    }
+
+private:
+    template <class Op>
+    static Float8 Apply(Float8 a, Float8 b, Op op) {
+        for (size_t i = 0; i < kFloatPacketSize; ++i) {
+            a.v_[i] = op(a.v_[i], b.v_[i]);
+        }
+        return a;
+    }
+
+    std::array<float, kFloatPacketSize> v_;
+#endif
+};
+
+// Packet layout and tolerances for scalar type T. Double packets give exactly the distances of
+// GetIntersectionDistance. Float packets are a filter for it: their tolerances are wider, so a
+// triangle the double test hits is still a hit in float (barring extreme grazing angles), and
+// hits are confirmed in double precision by the caller.
+template <class T>
+struct PacketTraits;
+
+template <>
+struct PacketTraits<double> {
+    using Simd = Double4;
+    static constexpr size_t kLanes = kPacketSize;
+    static inline const double kDetTolerance = kEps;
+    static inline const double kTolerance = kEps;
+};
+
+template <>
+struct PacketTraits<float> {
+    using Simd = Float8;
+    static constexpr size_t kLanes = kFloatPacketSize;
+    static inline const float kDetTolerance = 0;
+    static inline const float kTolerance = 1e-4f;
+};
+
+// Up to PacketTraits<T>::kLanes triangles in structure-of-arrays layout, stored as a vertex and
+// two edges so the intersection test doesn't recompute them. Unused lanes hold a degenerate
+// triangle that is never hit.
+template <class T>
+struct BasicTrianglePacket {
+    static constexpr size_t kLanes = PacketTraits<T>::kLanes;
+
+    alignas(32) std::array<std::array<T, kLanes>, 3> v0{};
+    alignas(32) std::array<std::array<T, kLanes>, 3> e1{};
+    alignas(32) std::array<std::array<T, kLanes>, 3> e2{};
+    std::array<uint32_t, kLanes> index{};
+    uint32_t count = 0;
+
+    // The edges are computed in double precision and rounded once.
+    void Add(const Triangle& triangle, uint32_t object_index) {
+        Vector e1_vector = triangle[1] - triangle[0];
+        Vector e2_vector = triangle[2] - triangle[0];
+        for (size_t axis = 0; axis < 3; ++axis) {
+            v0[axis][count] = static_cast<T>(triangle[0][axis]);
+            e1[axis][count] = static_cast<T>(e1_vector[axis]);
+            e2[axis][count] = static_cast<T>(e2_vector[axis]);
+        }
+        index[count++] = object_index;
+    }
+};
+
+using TrianglePacket = BasicTrianglePacket<double>;
+using FloatTrianglePacket = BasicTrianglePacket<float>;
+
+// Moller-Trumbore against all lanes of the packet at once. For double packets this is the same
+// math and kEps tolerances as GetIntersectionDistance(const Ray&, const Triangle&), see
+// PacketTraits for float ones. Lanes that miss get infinity.
+template <class T>
+std::array<T, PacketTraits<T>::kLanes> GetIntersectionDistances(
+    const Ray& ray, const BasicTrianglePacket<T>& packet) {
+    using Simd = typename PacketTraits<T>::Simd;
+    const Vector& o = ray.GetOrigin();
+    const Vector& d = ray.GetDirection();
+    Simd dx{static_cast<T>(d[0])}, dy{static_cast<T>(d[1])}, dz{static_cast<T>(d[2])};
+    Simd e1x{packet.e1[0].data()}, e1y{packet.e1[1].data()}, e1z{packet.e1[2].data()};
+    Simd e2x{packet.e2[0].data()}, e2y{packet.e2[1].data()}, e2z{packet.e2[2].data()};
+    Simd eps{PacketTraits<T>::kTolerance}, neg_eps{-PacketTraits<T>::kTolerance}, one{1};
+    Simd det_eps{PacketTraits<T>::kDetTolerance}, neg_det_eps{-PacketTraits<T>::kDetTolerance};
+
+    // pvec = d x e2, det = e1 . pvec
+    Simd px = dy * e2z - dz * e2y;
+    Simd py = dz * e2x - dx * e2z;
+    Simd pz = dx * e2y - dy * e2x;
+    Simd det = e1x * px + e1y * py + e1z * pz;
+    Simd hit = (det < neg_det_eps) | (det > det_eps);
+    Simd inv_det = one / det;
+
+    // tvec = o - v0, u = (tvec . pvec) / det
+    Simd tx = Simd{static_cast<T>(o[0])} - Simd{packet.v0[0].data()};
+    Simd ty = Simd{static_cast<T>(o[1])} - Simd{packet.v0[1].data()};
+    Simd tz = Simd{static_cast<T>(o[2])} - Simd{packet.v0[2].data()};
+    Simd u = (tx * px + ty * py + tz * pz) * inv_det;
+
+    // qvec = tvec x e1, v = (d . qvec) / det, t = (e2 . qvec) / det
+    Simd qx = ty * e1z - tz * e1y;
+    Simd qy = tz * e1x - tx * e1z;
+    Simd qz = tx * e1y - ty * e1x;
+    Simd v = (dx * qx + dy * qy + dz * qz) * inv_det;
+    Simd t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+    Simd miss = (u < neg_eps) | (u - one > eps) | (v < neg_eps) | (u + v - one > eps) |
+                (t < neg_eps);
+    Simd inf{std::numeric_limits<T>::infinity()};
+    alignas(32) std::array<T, PacketTraits<T>::kLanes> res;
+    Select(hit, Select(miss, inf, t), inf).Store(res.data());
+    return res;
+}
+
+// Scene triangles regrouped into packets along the leaves of a BVH built over them. Float
+// packets take half the memory of double ones and test twice as many triangles per
+// instruction.
+template <class T>
+class BasicTrianglePackets {
+public:
+    using Packet = BasicTrianglePacket<T>;
+
+    BasicTrianglePackets() = default;
+
+    BasicTrianglePackets(const Mesh& mesh, const BVH& bvh) {
+        offsets_.push_back(0);
+        for (uint32_t leaf = 0; leaf < bvh.LeafCount(); ++leaf) {
+            auto primitives = bvh.GetLeaf(leaf);
+            for (size_t i = 0; i < primitives.size(); i += Packet::kLanes) {
+                auto& packet = packets_.emplace_back();
+                for (size_t j = i; j < std::min(i + Packet::kLanes, primitives.size()); ++j) {
+                    packet.Add(mesh.GetTriangle(primitives[j]), primitives[j]);
+                }
+            }
+            offsets_.push_back(static_cast<uint32_t>(packets_.size()));
+        }
+    }
+
+    std::span<const Packet> GetLeaf(uint32_t leaf) const {
+        return std::span{packets_}.subspan(offsets_[leaf], offsets_[leaf + 1] - offsets_[leaf]);
+    }
+
+    bool Empty() const {
+        return packets_.empty();
+    }
+
+private:
+    std::vector<Packet> packets_;
+    std::vector<uint32_t> offsets_;
+};
+
+using TrianglePackets = BasicTrianglePackets<double>;
+using FloatTrianglePackets = BasicTrianglePackets<float>;
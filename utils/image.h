@@ -12,6 +12,85 @@ struct RGB {
     int r, g, b;
 };
 
+// Writes an 8bit RGBA png row by row, so the caller never needs to hold more than a row of it.
+// Rows are 4 * width bytes, top to bottom, and Finish must be called after the last one.
+class PngWriter {
+public:
+    PngWriter(const std::filesystem::path& path, int width, int height) : height_(height) {
+        assert(width > 0);
+        assert(height > 0);
+        fp_ = std::fopen(path.c_str(), "wb");
+        if (!fp_) {
+            throw std::runtime_error{"Can't open file " + path.string()};
+        }
+
+        png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (!png_) {
+            std::fclose(fp_);
+            throw std::runtime_error{"Can't create png write struct"};
+        }
+
+        info_ = png_create_info_struct(png_);
+        if (!info_) {
+            png_destroy_write_struct(&png_, nullptr);
+            std::fclose(fp_);
+            throw std::runtime_error{"Can't create png info struct"};
+        }
+
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+
+        png_init_io(png_, fp_);
+
+        // Output is 8bit depth, RGBA format.
+        png_set_IHDR(png_, info_, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_, info_);
+    }
+
+    ~PngWriter() {
+        if (png_) {
+            png_destroy_write_struct(&png_, &info_);
+            std::fclose(fp_);
+        }
+    }
+
+    PngWriter(const PngWriter&) = delete;
+    PngWriter& operator=(const PngWriter&) = delete;
+
+    void WriteRow(const png_byte* row) {
+        assert(rows_written_ < height_);
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_row(png_, row);
+        ++rows_written_;
+    }
+
+    void Finish() {
+        if (rows_written_ != height_) {
+            throw std::runtime_error{"Not all png rows are written"};
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_end(png_, nullptr);
+        png_destroy_write_struct(&png_, &info_);
+        png_ = nullptr;
+        if (std::fclose(fp_)) {
+            throw std::runtime_error{"Can't write png file"};
+        }
+    }
+
+private:
+    std::FILE* fp_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+    int height_;
+    int rows_written_ = 0;
+};
+
 class Image {
 public:
     Image(int width, int height) {
@@ -45,42 +124,11 @@ public:
         if (!width_) {
             throw std::runtime_error{"Image is empty"};
         }
-
-        auto* fp = std::fopen(path.c_str(), "wb");
-        if (!fp) {
-            throw std::runtime_error{"Can't open file " + path.string()};
-        }
-
-        auto png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-        if (!png) {
-            throw std::runtime_error{"Can't create png write struct"};
-        }
-
-        auto info = png_create_info_struct(png);
-        if (!info) {
-            throw std::runtime_error{"Can't create png info struct"};
-        }
-
-        if (setjmp(png_jmpbuf(png))) {
-            abort();
+        PngWriter writer{path, width_, height_};
+        for (auto row : std::span{bytes_, bytes_ + height_}) {
+            writer.WriteRow(row);
         }
-
-        png_init_io(png, fp);
-
-        // Output is 8bit depth, RGBA format.
-        png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-        png_write_info(png, info);
-
-        // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-        // Use png_set_filler().
-        // png_set_filler(png, 0, PNG_FILLER_AFTER);
-
-        png_write_image(png, bytes_);
-        png_write_end(png, nullptr);
-
-        std::fclose(fp);
-        png_destroy_write_struct(&png, &info);
+        writer.Finish();
     }
 
     RGB GetPixel(int y, int x) const {
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Number of workers to use for a requested thread count, 0 or less means one per hardware thread.
+int GetThreadCount(int requested) {
+    if (requested > 0) {
+        return requested;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Threads that live for the whole program and run the tasks submitted to them, so that a
+// ParallelFor call costs a wakeup instead of starting and joining threads.
+class ThreadPool {
+public:
+    static ThreadPool& Get() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock{mutex_};
+            stop_ = true;
+        }
+        task_added_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Queues copies tasks, starting threads until there are at least copies of them. Tasks
+    // left in the queue when the program ends are dropped.
+    void Submit(const std::function<void()>& task, size_t copies) {
+        {
+            std::lock_guard lock{mutex_};
+            while (threads_.size() < copies) {
+                threads_.emplace_back([this] { Run(); });
+            }
+            for (size_t i = 0; i < copies; ++i) {
+                tasks_.push_back(task);
+            }
+        }
+        task_added_.notify_all();
+    }
+
+private:
+    void Run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock{mutex_};
+                task_added_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (stop_) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable task_added_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+};
+
+// Runs func(index) for every index in [0, count) on up to `threads` workers: the calling thread
+// and helpers from ThreadPool. Indices are dealt to workers in contiguous blocks up front; a
+// worker that runs out of its own block steals from the back of the fullest one, so uneven
+// tasks still keep every worker busy. The calling thread can run every index by itself and
+// only waits for the ones helpers have started, so nested calls never wait for a helper that
+// is busy with an outer one. After an exception the remaining indices are skipped and the
+// first exception is rethrown.
+template <class Func>
+void ParallelFor(size_t count, int threads, Func&& func) {
+    size_t workers = std::min<size_t>(GetThreadCount(threads), count);
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    struct WorkQueue {
+        std::mutex mutex;
+        size_t begin;
+        size_t end;
+    };
+    // Shared with the helpers, some of which may only start after the call has returned. By then
+    // no index is left, so they never touch func.
+    struct State {
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+        std::atomic<size_t> next_worker = 1;
+        std::atomic<size_t> unfinished;
+        std::atomic<bool> failed = false;
+        std::mutex mutex;  // guards error and the wait for unfinished to reach 0
+        std::condition_variable finished;
+        std::exception_ptr error;
+        std::function<void(size_t)> func;
+    };
+    auto state = std::make_shared<State>();
+    for (size_t w = 0; w < workers; ++w) {
+        state->queues.push_back(std::make_unique<WorkQueue>());
+        state->queues.back()->begin = count * w / workers;
+        state->queues.back()->end = count * (w + 1) / workers;
+    }
+    state->unfinished = count;
+    state->func = [&func](size_t index) { func(index); };
+
+    auto work = [](State& state, size_t w) {
+        auto& queues = state.queues;
+        auto pop_own = [&]() -> std::optional<size_t> {
+            std::lock_guard lock{queues[w]->mutex};
+            if (queues[w]->begin == queues[w]->end) {
+                return std::nullopt;
+            }
+            return queues[w]->begin++;
+        };
+        auto steal = [&]() -> std::optional<size_t> {
+            while (true) {
+                size_t victim = 0, largest = 0;
+                for (size_t v = 0; v < queues.size(); ++v) {
+                    std::lock_guard lock{queues[v]->mutex};
+                    if (queues[v]->end - queues[v]->begin > largest) {
+                        largest = queues[v]->end - queues[v]->begin;
+                        victim = v;
+                    }
+                }
+                if (largest == 0) {
+                    return std::nullopt;
+                }
+                std::lock_guard lock{queues[victim]->mutex};
+                if (queues[victim]->begin < queues[victim]->end) {
+                    return --queues[victim]->end;
+                }
+            }
+        };
+        auto run = [&](size_t index) {
+            if (!state.failed) {
+                try {
+                    state.func(index);
+                } catch (...) {
+                    std::lock_guard lock{state.mutex};
+                    if (!state.error) {
+                        state.error = std::current_exception();
+                    }
+                    state.failed = true;
+                }
+            }
+            if (--state.unfinished == 0) {
+                std::lock_guard lock{state.mutex};
+                state.finished.notify_all();
+            }
+        };
+        while (auto index = pop_own()) {
+            run(*index);
+        }
+        while (auto index = steal()) {
+            run(*index);
+        }
+    };
+
+    ThreadPool::Get().Submit([state, work] { work(*state, state->next_worker++); }, workers - 1);
+    work(*state, 0);
+    std::unique_lock lock{state->mutex};
+    state->finished.wait(lock, [&] { return state->unfinished == 0; });
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}